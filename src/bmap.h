@@ -16,21 +16,58 @@
 #include <iostream>
 #endif
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <ios>
 #include <iterator>
+#include <limits>
+#include <new>
+#include <mutex>
 #include <ranges>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <tinyxml2.h>
 #include <unistd.h>
 
+// gzip compressed bmaps (.bmap.gz) need zlib
+#ifdef BMAP_WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #ifdef USE_GCC_COMPAT
 // compatibility for std::format if GCC < 13.
 // IWYU pragma is there because it doesn't recognize the format function
@@ -40,6 +77,8 @@
 #endif
 
 constexpr const size_t MAX_BUF_SIZE = 4 * 1024 * 1024 * 2;
+// buffer alignment of the copy engine, enough for O_DIRECT on any device
+constexpr const size_t IO_ALIGNMENT = 4096;
 
 namespace xml {
 template <typename T>
@@ -64,7 +103,15 @@ T value(const tinyxml2::XMLElement *elem) {
 template <typename T, typename = typename std::enable_if_t<
                           std::is_same_v<T, std::string>, T>>
 std::string value(const tinyxml2::XMLElement *elem) {
-    return std::string(elem->GetText());
+    if (elem == nullptr || elem->GetText() == nullptr)
+        throw std::runtime_error("Element is null");
+    // bmaptools pads values with spaces: "<ChecksumType> sha256 </ChecksumType>"
+    const std::string_view text(elem->GetText());
+    const auto first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string_view::npos)
+        return std::string();
+    const auto last = text.find_last_not_of(" \t\r\n");
+    return std::string(text.substr(first, last - first + 1));
 }
 
 template <Parseable T> T value(const tinyxml2::XMLElement *elem) {
@@ -93,6 +140,987 @@ T valueFromSimpleXPath(const tinyxml2::XMLElement *root,
 
 namespace bmap {
 
+namespace detail {
+
+class FileDescriptor {
+  public:
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+    ~FileDescriptor() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    int get() const { return fd; }
+
+  private:
+    int fd;
+};
+
+template <typename T, size_t Alignment> struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U> struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(
+            ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T *p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const {
+        return true;
+    }
+};
+
+// pread until len bytes are read or EOF is hit. Returns the bytes read.
+inline size_t readAt(int fd, size_t offset, void *buf, size_t len) {
+    auto ptr = static_cast<uint8_t *>(buf);
+    size_t done = 0;
+    while (done < len) {
+        const auto res = ::pread(fd, ptr + done, len - done, offset + done);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(
+                std::format("Read at offset {} failed: {}",
+                            std::to_string(offset + done), strerror(errno)));
+        }
+        if (res == 0)
+            break;
+        done += res;
+    }
+    return done;
+}
+
+// `flags` are pwritev2 flags, e.g. RWF_DSYNC
+inline void writeAt(int fd, size_t offset, const void *buf, size_t len,
+                    int flags = 0) {
+    auto ptr = static_cast<const uint8_t *>(buf);
+    for (size_t done = 0; done < len;) {
+        iovec iov{const_cast<uint8_t *>(ptr + done), len - done};
+        const auto res = flags ? ::pwritev2(fd, &iov, 1, offset + done, flags)
+                               : ::pwrite(fd, ptr + done, len - done,
+                                          offset + done);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(
+                std::format("Write at offset {} failed: {}",
+                            std::to_string(offset + done), strerror(errno)));
+        }
+        done += res;
+    }
+}
+
+inline void readExact(int fd, size_t offset, void *buf, size_t len) {
+    if (readAt(fd, offset, buf, len) != len) {
+        throw std::runtime_error(std::format(
+            "Unexpected end of image at offset {}", std::to_string(offset)));
+    }
+}
+
+inline unsigned threadCount(unsigned requested) {
+    if (requested > 0)
+        return requested;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// calls fn(worker, i) if it takes the index of the worker running it in
+// [0, threads), e.g. to pick per-worker state, fn(i) otherwise
+template <typename Fn>
+void invokeWorker(const Fn &fn, unsigned worker, size_t i) {
+    if constexpr (std::is_invocable_v<const Fn &, unsigned, size_t>) {
+        fn(worker, i);
+    } else {
+        fn(i);
+    }
+}
+
+// run fn(i) or fn(worker, i) for i in [0, count) on up to `threads` workers
+template <typename Fn>
+void parallelFor(size_t count, unsigned threads, const Fn &fn) {
+    threads = unsigned(std::min<size_t>(threads, count));
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            invokeWorker(fn, 0, i);
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            try {
+                for (auto i = next++; i < count; i = next++)
+                    invokeWorker(fn, t, i);
+            } catch (...) {
+                std::lock_guard lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+inline bool isZeroScalar(const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t words[4];
+        std::memcpy(words, data + i, sizeof(words));
+        if (words[0] | words[1] | words[2] | words[3])
+            return false;
+    }
+    for (; i < len; i++) {
+        if (data[i])
+            return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("avx2"))) inline bool isZeroAvx2(const uint8_t *data,
+                                                        size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        const auto a = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(data + i));
+        const auto b = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(data + i + 32));
+        const auto c = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(data + i + 64));
+        const auto d = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(data + i + 96));
+        const auto any =
+            _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any))
+            return false;
+    }
+    return isZeroScalar(data + i, len - i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+inline bool isZeroNeon(const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const auto any = vorrq_u8(vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)),
+                                  vorrq_u8(vld1q_u8(data + i + 32),
+                                           vld1q_u8(data + i + 48)));
+        if (vmaxvq_u8(any) != 0)
+            return false;
+    }
+    return isZeroScalar(data + i, len - i);
+}
+#endif
+
+/**
+    True if all `len` bytes are zero. Uses AVX2 if the CPU supports it
+    (checked at runtime, no -mavx2 needed) or NEON on aarch64.
+*/
+inline bool isZero(const uint8_t *data, size_t len) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        return isZeroAvx2(data, len);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return isZeroNeon(data, len);
+#endif
+    return isZeroScalar(data, len);
+}
+
+} // namespace detail
+
+/**
+    Minimal SHA-256 implementation (FIPS 180-4) used for the per range
+    checksums and the BmapFileChecksum of bmap format 2.0.
+*/
+class Sha256 {
+  public:
+    static constexpr size_t DIGEST_SIZE = 32;
+
+    Sha256() { reset(); }
+
+    void reset() {
+        state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        bufferLen = 0;
+        totalLen = 0;
+    }
+
+    void update(const void *data, size_t len) {
+        auto bytes = static_cast<const uint8_t *>(data);
+        totalLen += len;
+        if (bufferLen > 0) {
+            const auto take = std::min(len, buffer.size() - bufferLen);
+            std::memcpy(buffer.data() + bufferLen, bytes, take);
+            bufferLen += take;
+            bytes += take;
+            len -= take;
+            if (bufferLen < buffer.size())
+                return;
+            compress(buffer.data());
+            bufferLen = 0;
+        }
+        for (; len >= buffer.size(); len -= buffer.size()) {
+            compress(bytes);
+            bytes += buffer.size();
+        }
+        std::memcpy(buffer.data(), bytes, len);
+        bufferLen = len;
+    }
+
+    std::array<uint8_t, DIGEST_SIZE> digest() {
+        const uint64_t bitLen = totalLen * 8;
+        const uint8_t pad = 0x80;
+        update(&pad, 1);
+        const uint8_t zero = 0;
+        while (bufferLen != 56)
+            update(&zero, 1);
+        std::array<uint8_t, 8> lenBytes;
+        for (size_t i = 0; i < lenBytes.size(); i++)
+            lenBytes[i] = uint8_t(bitLen >> (56 - 8 * i));
+        update(lenBytes.data(), lenBytes.size());
+
+        std::array<uint8_t, DIGEST_SIZE> out;
+        for (size_t i = 0; i < state.size(); i++) {
+            out[i * 4] = uint8_t(state[i] >> 24);
+            out[i * 4 + 1] = uint8_t(state[i] >> 16);
+            out[i * 4 + 2] = uint8_t(state[i] >> 8);
+            out[i * 4 + 3] = uint8_t(state[i]);
+        }
+        reset();
+        return out;
+    }
+
+    std::string hexdigest() {
+        constexpr const char *hex = "0123456789abcdef";
+        std::string res;
+        res.reserve(DIGEST_SIZE * 2);
+        for (const auto b : digest()) {
+            res.push_back(hex[b >> 4]);
+            res.push_back(hex[b & 0xf]);
+        }
+        return res;
+    }
+
+    static std::string hash(const void *data, size_t len) {
+        Sha256 sha;
+        sha.update(data, len);
+        return sha.hexdigest();
+    }
+
+  private:
+    static constexpr std::array<uint32_t, 64> K = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    static constexpr uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(const uint8_t *block) {
+        std::array<uint32_t, 64> w;
+        for (size_t i = 0; i < 16; i++) {
+            w[i] = (uint32_t(block[i * 4]) << 24) |
+                   (uint32_t(block[i * 4 + 1]) << 16) |
+                   (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+        }
+        for (size_t i = 16; i < 64; i++) {
+            const auto s0 =
+                rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const auto s1 =
+                rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto [a, b, c, d, e, f, g, h] = state;
+        for (size_t i = 0; i < 64; i++) {
+            const auto s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            const auto ch = (e & f) ^ (~e & g);
+            const auto t1 = h + s1 + ch + K[i] + w[i];
+            const auto s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            const auto maj = (a & b) ^ (a & c) ^ (b & c);
+            const auto t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    std::array<uint32_t, 8> state;
+    std::array<uint8_t, 64> buffer;
+    size_t bufferLen;
+    uint64_t totalLen;
+};
+
+namespace detail {
+namespace blake3 {
+
+constexpr size_t BLOCK_LEN = 64;
+constexpr size_t CHUNK_LEN = 1024;
+
+constexpr uint32_t CHUNK_START = 1 << 0;
+constexpr uint32_t CHUNK_END = 1 << 1;
+constexpr uint32_t PARENT = 1 << 2;
+constexpr uint32_t ROOT = 1 << 3;
+
+constexpr std::array<uint32_t, 8> IV = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+
+// message word order of the 7 rounds, each round permutes the previous one
+constexpr auto SCHEDULE = []() {
+    constexpr std::array<uint8_t, 16> permutation = {
+        2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+    std::array<std::array<uint8_t, 16>, 7> schedule{};
+    for (uint8_t i = 0; i < 16; i++)
+        schedule[0][i] = i;
+    for (size_t round = 1; round < schedule.size(); round++) {
+        for (size_t i = 0; i < 16; i++)
+            schedule[round][i] = schedule[round - 1][permutation[i]];
+    }
+    return schedule;
+}();
+
+// T is uint32_t or a GCC vector of uint32_t lanes, one message per lane
+template <typename T>
+[[gnu::always_inline]] inline void g(T *v, size_t a, size_t b, size_t c,
+                                     size_t d, const T &x, const T &y) {
+    v[a] = v[a] + v[b] + x;
+    v[d] = v[d] ^ v[a];
+    v[d] = (v[d] >> 16) | (v[d] << 16);
+    v[c] = v[c] + v[d];
+    v[b] = v[b] ^ v[c];
+    v[b] = (v[b] >> 12) | (v[b] << 20);
+    v[a] = v[a] + v[b] + y;
+    v[d] = v[d] ^ v[a];
+    v[d] = (v[d] >> 8) | (v[d] << 24);
+    v[c] = v[c] + v[d];
+    v[b] = v[b] ^ v[c];
+    v[b] = (v[b] >> 7) | (v[b] << 25);
+}
+
+template <typename T>
+[[gnu::always_inline]] inline void rounds(T *v, const T *m) {
+    for (const auto &s : SCHEDULE) {
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+}
+
+inline uint32_t load32(const uint8_t *p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 |
+           uint32_t(p[3]) << 24;
+}
+
+inline std::array<uint32_t, 16> compress(const uint32_t *cv, const uint32_t *m,
+                                         uint64_t counter, uint32_t blockLen,
+                                         uint32_t flags) {
+    std::array<uint32_t, 16> v = {
+        cv[0],  cv[1],  cv[2],          cv[3],
+        cv[4],  cv[5],  cv[6],          cv[7],
+        IV[0],  IV[1],  IV[2],          IV[3],
+        uint32_t(counter), uint32_t(counter >> 32), blockLen, flags};
+    rounds(v.data(), m);
+    for (size_t i = 0; i < 8; i++) {
+        v[i] ^= v[i + 8];
+        v[i + 8] ^= cv[i];
+    }
+    return v;
+}
+
+inline void parentCv(const uint32_t *children, uint32_t *out) {
+    const auto v = compress(IV.data(), children, 0, BLOCK_LEN, PARENT);
+    std::memcpy(out, v.data(), 8 * sizeof(uint32_t));
+}
+
+/**
+    Chaining values of N consecutive full chunks, hashed side by side with
+    one chunk per vector lane.
+*/
+template <typename V, size_t N>
+[[gnu::always_inline]] inline void hashChunksWide(const uint8_t *input,
+                                                  uint64_t counter,
+                                                  uint32_t *cvs) {
+    uint32_t lanes[N];
+    V counterLow, counterHigh;
+    for (size_t lane = 0; lane < N; lane++)
+        lanes[lane] = uint32_t(counter + lane);
+    std::memcpy(&counterLow, lanes, sizeof(lanes));
+    for (size_t lane = 0; lane < N; lane++)
+        lanes[lane] = uint32_t((counter + lane) >> 32);
+    std::memcpy(&counterHigh, lanes, sizeof(lanes));
+
+    V cv[8];
+    for (size_t i = 0; i < 8; i++)
+        cv[i] = V{} + IV[i];
+
+    for (size_t block = 0; block < CHUNK_LEN / BLOCK_LEN; block++) {
+        V m[16];
+        for (size_t word = 0; word < 16; word++) {
+            for (size_t lane = 0; lane < N; lane++) {
+                lanes[lane] = load32(input + lane * CHUNK_LEN +
+                                     block * BLOCK_LEN + word * 4);
+            }
+            std::memcpy(&m[word], lanes, sizeof(lanes));
+        }
+        const auto flags = (block == 0 ? CHUNK_START : 0) |
+                           (block == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+        V v[16] = {cv[0],        cv[1],        cv[2],        cv[3],
+                   cv[4],        cv[5],        cv[6],        cv[7],
+                   V{} + IV[0],  V{} + IV[1],  V{} + IV[2],  V{} + IV[3],
+                   counterLow,   counterHigh,  V{} + uint32_t(BLOCK_LEN),
+                   V{} + flags};
+        rounds(v, m);
+        for (size_t i = 0; i < 8; i++)
+            cv[i] = v[i] ^ v[i + 8];
+    }
+
+    for (size_t i = 0; i < 8; i++) {
+        std::memcpy(lanes, &cv[i], sizeof(lanes));
+        for (size_t lane = 0; lane < N; lane++)
+            cvs[lane * 8 + i] = lanes[lane];
+    }
+}
+
+using U32x4 = uint32_t __attribute__((vector_size(16)));
+using U32x8 = uint32_t __attribute__((vector_size(32)));
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("avx2"))) inline void
+hashChunksAvx2(const uint8_t *input, uint64_t counter, uint32_t *cvs) {
+    hashChunksWide<U32x8, 8>(input, counter, cvs);
+}
+#endif
+
+/**
+    Chaining values of `count` full chunks. 8 lanes with AVX2 (checked at
+    runtime), 4 lanes with SSE2 or NEON.
+*/
+inline void hashChunks(const uint8_t *input, size_t count, uint64_t counter,
+                       uint32_t *cvs) {
+    size_t i = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        for (; i + 8 <= count; i += 8)
+            hashChunksAvx2(input + i * CHUNK_LEN, counter + i, cvs + i * 8);
+    }
+#endif
+    for (; i + 4 <= count; i += 4)
+        hashChunksWide<U32x4, 4>(input + i * CHUNK_LEN, counter + i, cvs + i * 8);
+    for (; i < count; i++)
+        hashChunksWide<uint32_t, 1>(input + i * CHUNK_LEN, counter + i, cvs + i * 8);
+}
+
+// reduces `count` (a power of two) chaining values in place to `keep`
+inline void reduce(uint32_t *cvs, size_t count, size_t keep) {
+    for (; count > keep; count /= 2) {
+        for (size_t i = 0; i < count / 2; i++)
+            parentCv(cvs + i * 16, cvs + i * 8);
+    }
+}
+
+/**
+    Chaining values of the two halves of a subtree of `chunks` full chunks,
+    `chunks` is a power of two and at least 2. Parts of 256 chunks are
+    hashed on up to `threads` threads.
+*/
+inline void subtreeChildren(const uint8_t *input, size_t chunks,
+                            uint64_t counter, unsigned threads, uint32_t *out) {
+    const auto partChunks = std::min<size_t>(chunks / 2, 256);
+    const auto parts = chunks / partChunks;
+    std::vector<uint32_t> cvs(parts * 8);
+    parallelFor(parts, threads, [&](size_t part) {
+        std::vector<uint32_t> leaves(partChunks * 8);
+        hashChunks(input + part * partChunks * CHUNK_LEN, partChunks,
+                   counter + part * partChunks, leaves.data());
+        reduce(leaves.data(), partChunks, 1);
+        std::memcpy(cvs.data() + part * 8, leaves.data(), 8 * sizeof(uint32_t));
+    });
+    reduce(cvs.data(), parts, 2);
+    std::memcpy(out, cvs.data(), 16 * sizeof(uint32_t));
+}
+
+} // namespace blake3
+} // namespace detail
+
+/**
+    BLAKE3 hash, used for bmaps with the "blake3" ChecksumType extension.
+    Input is hashed as a tree of 1 KiB chunks: whole subtrees of large
+    updates are hashed with SIMD across chunks and split over `threads`
+    threads, so big ranges hash in parallel without any extra index.
+*/
+class Blake3 {
+  public:
+    static constexpr size_t DIGEST_SIZE = 32;
+
+    explicit Blake3(unsigned threads = 1) : threads(threads) { reset(); }
+
+    // threads for the following updates
+    void setThreads(unsigned count) { threads = std::max(1u, count); }
+
+    void reset() {
+        startChunk(0);
+        stackLen = 0;
+    }
+
+    void update(const void *data, size_t len) {
+        using namespace detail::blake3;
+        auto input = static_cast<const uint8_t *>(data);
+
+        if (chunkLen() > 0) {
+            const auto take = std::min(CHUNK_LEN - chunkLen(), len);
+            chunkUpdate(input, take);
+            input += take;
+            len -= take;
+            if (len == 0)
+                return;
+            // more input follows, so the full chunk is not the root
+            pushCv(chunkOutput().chainingValue().data(), chunkCounter);
+            startChunk(chunkCounter + 1);
+        }
+
+        // the last chunk stays buffered, it may turn out to be the root
+        while (len > CHUNK_LEN) {
+            auto subtreeLen = std::bit_floor(len);
+            // subtrees have to be aligned to their size within the tree
+            while (((subtreeLen - 1) & (chunkCounter * CHUNK_LEN)) != 0)
+                subtreeLen /= 2;
+            const auto subtreeChunks = subtreeLen / CHUNK_LEN;
+            if (subtreeChunks == 1) {
+                std::array<uint32_t, 8> cv;
+                hashChunks(input, 1, chunkCounter, cv.data());
+                pushCv(cv.data(), chunkCounter);
+            } else {
+                // keep the two halves apart, their parent may be the root
+                std::array<uint32_t, 16> children;
+                subtreeChildren(input, subtreeChunks, chunkCounter, threads,
+                                children.data());
+                pushCv(children.data(), chunkCounter);
+                pushCv(children.data() + 8, chunkCounter + subtreeChunks / 2);
+            }
+            startChunk(chunkCounter + subtreeChunks);
+            input += subtreeLen;
+            len -= subtreeLen;
+        }
+
+        if (len > 0) {
+            chunkUpdate(input, len);
+            mergeStack(chunkCounter);
+        }
+    }
+
+    std::array<uint8_t, DIGEST_SIZE> digest() {
+        using namespace detail::blake3;
+        Output output;
+        size_t remaining = stackLen;
+        if (stackLen == 0 || chunkLen() > 0) {
+            output = chunkOutput();
+        } else {
+            remaining -= 2;
+            output = parentOutput(stack[remaining].data(),
+                                  stack[remaining + 1].data());
+        }
+        while (remaining > 0) {
+            remaining--;
+            const auto right = output.chainingValue();
+            output = parentOutput(stack[remaining].data(), right.data());
+        }
+
+        const auto words = compress(output.cv.data(), output.block.data(), 0,
+                                    output.blockLen, output.flags | ROOT);
+        std::array<uint8_t, DIGEST_SIZE> out;
+        for (size_t i = 0; i < 8; i++) {
+            out[i * 4] = uint8_t(words[i]);
+            out[i * 4 + 1] = uint8_t(words[i] >> 8);
+            out[i * 4 + 2] = uint8_t(words[i] >> 16);
+            out[i * 4 + 3] = uint8_t(words[i] >> 24);
+        }
+        reset();
+        return out;
+    }
+
+    std::string hexdigest() {
+        constexpr const char *hex = "0123456789abcdef";
+        std::string res;
+        res.reserve(DIGEST_SIZE * 2);
+        for (const auto b : digest()) {
+            res.push_back(hex[b >> 4]);
+            res.push_back(hex[b & 0xf]);
+        }
+        return res;
+    }
+
+    static std::string hash(const void *data, size_t len,
+                            unsigned threads = 1) {
+        Blake3 blake3(threads);
+        blake3.update(data, len);
+        return blake3.hexdigest();
+    }
+
+  private:
+    // a node whose last compression is still pending
+    struct Output {
+        std::array<uint32_t, 8> cv;
+        std::array<uint32_t, 16> block;
+        uint32_t blockLen;
+        uint64_t counter;
+        uint32_t flags;
+
+        std::array<uint32_t, 8> chainingValue() const {
+            const auto v = detail::blake3::compress(cv.data(), block.data(),
+                                                    counter, blockLen, flags);
+            std::array<uint32_t, 8> out;
+            std::copy_n(v.begin(), out.size(), out.begin());
+            return out;
+        }
+    };
+
+    static Output parentOutput(const uint32_t *left, const uint32_t *right) {
+        using namespace detail::blake3;
+        Output output{IV, {}, BLOCK_LEN, 0, PARENT};
+        std::copy_n(left, 8, output.block.begin());
+        std::copy_n(right, 8, output.block.begin() + 8);
+        return output;
+    }
+
+    void startChunk(uint64_t counter) {
+        chunkCv = detail::blake3::IV;
+        chunkCounter = counter;
+        blockLen = 0;
+        blocksCompressed = 0;
+    }
+
+    size_t chunkLen() const {
+        return blocksCompressed * detail::blake3::BLOCK_LEN + blockLen;
+    }
+
+    uint32_t startFlag() const {
+        return blocksCompressed == 0 ? detail::blake3::CHUNK_START : 0;
+    }
+
+    void compressBlock(const uint8_t *data) {
+        using namespace detail::blake3;
+        std::array<uint32_t, 16> m;
+        for (size_t i = 0; i < m.size(); i++)
+            m[i] = load32(data + i * 4);
+        const auto v = compress(chunkCv.data(), m.data(), chunkCounter,
+                                BLOCK_LEN, startFlag());
+        std::copy_n(v.begin(), chunkCv.size(), chunkCv.begin());
+        blocksCompressed++;
+    }
+
+    void chunkUpdate(const uint8_t *input, size_t len) {
+        using namespace detail::blake3;
+        while (len > 0) {
+            // a full block is only compressed once more input follows, the
+            // last block of the chunk needs CHUNK_END
+            if (blockLen == BLOCK_LEN) {
+                compressBlock(block.data());
+                blockLen = 0;
+            }
+            if (blockLen == 0) {
+                for (; len > BLOCK_LEN; len -= BLOCK_LEN, input += BLOCK_LEN)
+                    compressBlock(input);
+            }
+            const auto take = std::min(BLOCK_LEN - blockLen, len);
+            std::memcpy(block.data() + blockLen, input, take);
+            blockLen += take;
+            input += take;
+            len -= take;
+        }
+    }
+
+    Output chunkOutput() const {
+        using namespace detail::blake3;
+        std::array<uint8_t, BLOCK_LEN> padded{};
+        std::memcpy(padded.data(), block.data(), blockLen);
+        Output output{chunkCv, {}, uint32_t(blockLen), chunkCounter,
+                      startFlag() | CHUNK_END};
+        for (size_t i = 0; i < output.block.size(); i++)
+            output.block[i] = load32(padded.data() + i * 4);
+        return output;
+    }
+
+    // merges completed subtrees, `chunks` is the number of chunks so far
+    void mergeStack(uint64_t chunks) {
+        const auto keep = size_t(std::popcount(chunks));
+        while (stackLen > keep) {
+            std::array<uint32_t, 16> children;
+            std::copy_n(stack[stackLen - 2].begin(), 8, children.begin());
+            std::copy_n(stack[stackLen - 1].begin(), 8, children.begin() + 8);
+            detail::blake3::parentCv(children.data(), stack[stackLen - 2].data());
+            stackLen--;
+        }
+    }
+
+    void pushCv(const uint32_t *cv, uint64_t chunks) {
+        mergeStack(chunks);
+        std::copy_n(cv, 8, stack[stackLen].begin());
+        stackLen++;
+    }
+
+    unsigned threads;
+
+    std::array<uint32_t, 8> chunkCv;
+    uint64_t chunkCounter;
+    std::array<uint8_t, detail::blake3::BLOCK_LEN> block;
+    size_t blockLen;
+    size_t blocksCompressed;
+
+    // one entry per level, 2^54 chunks exceed any 64 bit length
+    std::array<std::array<uint32_t, 8>, 54> stack;
+    size_t stackLen;
+};
+
+/**
+    Hash selected by the ChecksumType of a bmap: "sha256" as used by
+    bmaptools, or the "blake3" extension.
+*/
+class Checksum {
+  public:
+    explicit Checksum(std::string_view type, unsigned threads = 1)
+        : impl(make(type, threads)) {}
+
+    static bool supported(std::string_view type) {
+        return type == "sha256" || type == "blake3";
+    }
+
+    void update(const void *data, size_t len) {
+        std::visit([&](auto &hash) { hash.update(data, len); }, impl);
+    }
+
+    std::string hexdigest() {
+        return std::visit([](auto &hash) { return hash.hexdigest(); }, impl);
+    }
+
+    void reset() {
+        std::visit([](auto &hash) { hash.reset(); }, impl);
+    }
+
+    // threads for the following updates, only BLAKE3 uses more than one
+    void setThreads(unsigned count) {
+        if (auto *blake3 = std::get_if<Blake3>(&impl))
+            blake3->setThreads(count);
+    }
+
+    static std::string hash(std::string_view type, const void *data,
+                            size_t len) {
+        Checksum checksum(type);
+        checksum.update(data, len);
+        return checksum.hexdigest();
+    }
+
+  private:
+    static std::variant<Sha256, Blake3> make(std::string_view type,
+                                             unsigned threads) {
+        if (type == "sha256")
+            return Sha256();
+        if (type == "blake3")
+            return Blake3(threads);
+        throw std::runtime_error(std::format("Unsupported checksum type {}",
+                                             std::string(type)));
+    }
+
+    std::variant<Sha256, Blake3> impl;
+};
+
+namespace detail {
+
+/**
+    Buffered text writer for the bmap serializer. Numbers are formatted with
+    std::to_chars, full buffers are handed to `sink(data, len)`.
+*/
+template <typename Sink> class XmlWriter {
+  public:
+    explicit XmlWriter(Sink sink) : sink(std::move(sink)) {}
+
+    XmlWriter &operator<<(std::string_view text) {
+        if (used + text.size() > buffer.size())
+            flush();
+        if (text.size() > buffer.size()) {
+            sink(text.data(), text.size());
+            return *this;
+        }
+        std::memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+        return *this;
+    }
+
+    XmlWriter &operator<<(size_t value) {
+        if (used + std::numeric_limits<size_t>::digits10 + 1 > buffer.size())
+            flush();
+        const auto result = std::to_chars(buffer.data() + used,
+                                          buffer.data() + buffer.size(), value);
+        used = result.ptr - buffer.data();
+        return *this;
+    }
+
+    void flush() {
+        if (used > 0)
+            sink(buffer.data(), used);
+        used = 0;
+    }
+
+  private:
+    Sink sink;
+    std::array<char, 64 * 1024> buffer;
+    size_t used = 0;
+};
+
+inline bool isGzip(const char *data, size_t len) {
+    return len >= 2 && uint8_t(data[0]) == 0x1f && uint8_t(data[1]) == 0x8b;
+}
+
+inline bool isZstd(const char *data, size_t len) {
+    return len >= 4 && uint8_t(data[0]) == 0x28 && uint8_t(data[1]) == 0xb5 &&
+           uint8_t(data[2]) == 0x2f && uint8_t(data[3]) == 0xfd;
+}
+
+[[noreturn]] inline void compressedBmapUnsupported(bool zstd) {
+    if (zstd) {
+        throw std::runtime_error(
+            "zstd compressed bmaps are not supported, use .bmap.gz");
+    }
+    throw std::runtime_error(
+        "gzip compressed bmap, but built without BMAP_WITH_ZLIB");
+}
+
+/**
+    Inflates gzip (or zlib) data held in memory, e.g. a .bmap.gz fetched over
+    HTTP. Concatenated gzip members are inflated one after another.
+*/
+inline std::vector<char> gunzip(const std::vector<char> &compressed) {
+#ifdef BMAP_WITH_ZLIB
+    z_stream zs{};
+    // 15 window bits + 32: detect the gzip or zlib header
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        throw std::runtime_error("inflateInit failed");
+    }
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
+    zs.avail_in = compressed.size();
+
+    std::vector<char> data;
+    for (;;) {
+        const auto used = data.size();
+        data.resize(std::max<size_t>(used * 2, 64 * 1024));
+        zs.next_out = reinterpret_cast<Bytef *>(data.data() + used);
+        zs.avail_out = data.size() - used;
+        const auto ret = inflate(&zs, Z_NO_FLUSH);
+        data.resize(data.size() - zs.avail_out);
+        if (ret == Z_STREAM_END && zs.avail_in == 0)
+            break;
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);
+        } else if (ret != Z_OK && !(ret == Z_BUF_ERROR && zs.avail_in > 0)) {
+            inflateEnd(&zs);
+            throw std::runtime_error("Corrupt or truncated gzip compressed bmap");
+        }
+    }
+    inflateEnd(&zs);
+    return data;
+#else
+    (void)compressed;
+    compressedBmapUnsupported(false);
+#endif
+}
+
+/**
+    Contents of the bmap file at `path`. gzip compressed files are inflated
+    while they are read, so only the XML is held in memory.
+*/
+inline std::vector<char> readBmapFile(const std::string &path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, sizeof(magic));
+    const size_t magicLen = file.gcount();
+    if (isZstd(magic, magicLen))
+        compressedBmapUnsupported(true);
+    if (!isGzip(magic, magicLen)) {
+        file.clear();
+        file.seekg(0);
+        return std::vector<char>((std::istreambuf_iterator<char>(file)),
+                                 std::istreambuf_iterator<char>());
+    }
+
+#ifdef BMAP_WITH_ZLIB
+    const std::unique_ptr<gzFile_s, int (*)(gzFile)> gz(
+        gzopen(path.c_str(), "rb"), gzclose);
+    if (!gz) {
+        throw std::runtime_error(std::format("Unable to open {}", path));
+    }
+    gzbuffer(gz.get(), 256 * 1024);
+    std::vector<char> data;
+    for (;;) {
+        const auto used = data.size();
+        data.resize(std::max<size_t>(used * 2, 256 * 1024));
+        const auto len = gzread(gz.get(), data.data() + used,
+                                unsigned(data.size() - used));
+        if (len < 0) {
+            int err = 0;
+            throw std::runtime_error(std::format(
+                "Unable to decompress {}: {}", path,
+                std::string(gzerror(gz.get(), &err))));
+        }
+        data.resize(used + len);
+        if (len == 0)
+            break;
+    }
+    return data;
+#else
+    compressedBmapUnsupported(false);
+#endif
+}
+
+} // namespace detail
+
 struct Range {
     size_t offset;
     size_t blockCount;
@@ -130,7 +1158,7 @@ struct Range {
         return Range{
             start,
             len,
-            std::string(checksum),
+            checksum ? std::string(checksum) : std::string(),
         };
     }
 };
@@ -146,22 +1174,26 @@ struct BmapFile {
 
     std::vector<Range> blockMap;
 
+    /**
+        Reads a plain or gzip compressed (.bmap.gz) bmap and checks its
+        BmapFileChecksum.
+    */
     static BmapFile from_xml(const std::string &xmlPath) {
         if (!std::filesystem::exists(xmlPath)) {
             throw std::runtime_error(std::format(
                 "File not found! Path {} does not exist.", xmlPath));
         }
-        std::ifstream file(xmlPath, std::ios::in);
-        std::vector<char> data((std::istreambuf_iterator<char>(file)),
-                               std::istreambuf_iterator<char>());
-
-        return from_xml_data(data);
+        return from_xml_data(detail::readBmapFile(xmlPath));
     }
 
     static BmapFile from_xml_data(const std::vector<char> &bytes) {
         if (bytes.empty()) {
             throw std::runtime_error("bmap file is empty!");
         }
+        if (detail::isZstd(bytes.data(), bytes.size()))
+            detail::compressedBmapUnsupported(true);
+        if (detail::isGzip(bytes.data(), bytes.size()))
+            return from_xml_data(detail::gunzip(bytes));
 
         tinyxml2::XMLDocument doc;
         doc.Parse(bytes.data(), bytes.size());
@@ -192,21 +1224,179 @@ struct BmapFile {
             }
         }
 
-        return BmapFile{imageSize,  blockSize, blocksCount, mappedBlocksCount,
-                        chcksmType, chcksum,   blockMap};
+        if (blockSize == 0) {
+            throw std::runtime_error("bmap file has a block size of 0");
+        }
+        auto bmapFile =
+            BmapFile{imageSize,  blockSize, blocksCount, mappedBlocksCount,
+                     chcksmType, chcksum,   std::move(blockMap)};
+        bmapFile.verifyFileChecksum(std::string_view(bytes.data(), bytes.size()));
+        if (!bmapFile.normalized()) {
+            // writers that list overlapping ranges may count them twice
+            size_t listed = 0;
+            for (const auto &range : bmapFile.blockMap)
+                listed += range.blockCount;
+            bmapFile.normalize();
+            if (mappedBlocksCount != listed &&
+                mappedBlocksCount != bmapFile.mappedBlocksCount) {
+                throw std::runtime_error(std::format(
+                    "MappedBlocksCount {} does not match the {} mapped blocks",
+                    std::to_string(mappedBlocksCount),
+                    std::to_string(bmapFile.mappedBlocksCount)));
+            }
+        }
+        return bmapFile;
     }
 
-#ifdef BMAP_DEBUG_PRINT
-    void print() const {
-        std::cout << "Bmap: \n"
-                  << "  imageSize: " << imageSize << "\n"
-                  << "  blockSize: " << blockSize << "\n"
-                  << "  blocks: " << blocksCount << "\n"
-                  << "  mappedBlocks: " << mappedBlocksCount << "\n"
-                  << "  checksumType: " << checksumType << "\n"
-                  << "  checksum: " << checksum << "\n"
-                  << "  BlockMap: \n";
-
+    /**
+        True if the ranges are sorted, non-empty, don't overlap, end within
+        the image and add up to mappedBlocksCount. One pass over the ranges.
+    */
+    bool normalized() const {
+        size_t end = 0;
+        size_t mapped = 0;
+        for (const auto &range : blockMap) {
+            if (range.blockCount == 0 || range.offset < end ||
+                range.offset > blocksCount ||
+                range.blockCount > blocksCount - range.offset)
+                return false;
+            end = range.offset + range.blockCount;
+            mapped += range.blockCount;
+        }
+        return mapped == mappedBlocksCount;
+    }
+
+    /**
+        Sorts the ranges, drops empty ones, merges overlapping and duplicate
+        ones and recalculates mappedBlocksCount, so the copy engines can rely
+        on a sorted plan without overlaps. Merged ranges lose their checksum.
+        Adjacent ranges are only merged with `mergeAdjacent` or if neither
+        has a checksum. Throws for ranges past the end of the image and for
+        duplicates with different checksums.
+    */
+    void normalize(bool mergeAdjacent = false) {
+        auto &ranges = blockMap;
+        std::erase_if(ranges,
+                      [](const Range &range) { return range.blockCount == 0; });
+        // bmaps are written sorted, only sort when they are not
+        const auto byOffset = [](const Range &a, const Range &b) {
+            return a.offset < b.offset;
+        };
+        if (!std::is_sorted(ranges.begin(), ranges.end(), byOffset))
+            std::stable_sort(ranges.begin(), ranges.end(), byOffset);
+
+        std::vector<Range> merged;
+        merged.reserve(ranges.size());
+        for (auto &range : ranges) {
+            if (range.offset > blocksCount ||
+                range.blockCount > blocksCount - range.offset) {
+                throw std::runtime_error(std::format(
+                    "Range {}-{} is past the end of the image ({} blocks)",
+                    std::to_string(range.offset),
+                    std::to_string(range.offset + range.blockCount - 1),
+                    std::to_string(blocksCount)));
+            }
+            if (merged.empty()) {
+                merged.push_back(std::move(range));
+                continue;
+            }
+            auto &last = merged.back();
+            const auto lastEnd = last.offset + last.blockCount;
+            if (range.offset == last.offset &&
+                range.blockCount == last.blockCount) {
+                // the same range listed twice, e.g. by two merged bmaps
+                if (!range.checksum.empty() && !last.checksum.empty() &&
+                    range.checksum != last.checksum) {
+                    throw std::runtime_error(std::format(
+                        "Conflicting checksums for range {}-{}",
+                        std::to_string(range.offset),
+                        std::to_string(lastEnd - 1)));
+                }
+                if (last.checksum.empty())
+                    last.checksum = std::move(range.checksum);
+            } else if (range.offset < lastEnd ||
+                       (range.offset == lastEnd &&
+                        (mergeAdjacent ||
+                         (last.checksum.empty() && range.checksum.empty())))) {
+                last.blockCount =
+                    std::max(lastEnd, range.offset + range.blockCount) -
+                    last.offset;
+                last.checksum.clear();
+            } else {
+                merged.push_back(std::move(range));
+            }
+        }
+        ranges = std::move(merged);
+
+        mappedBlocksCount = 0;
+        for (const auto &range : ranges)
+            mappedBlocksCount += range.blockCount;
+    }
+
+    /**
+        Serialize to bmap format 2.0. BmapFileChecksum is calculated over the
+        document with the checksum field filled with zeroes, the same way
+        bmaptools does it.
+    */
+    std::string to_xml() const {
+        const auto placeholder = std::string(Sha256::DIGEST_SIZE * 2, '0');
+
+        std::string xml;
+        xml.reserve(512 + blockMap.size() * 100);
+        detail::XmlWriter out([&](const char *data, size_t len) {
+            xml.append(data, len);
+        });
+        serialize(out, placeholder);
+        out.flush();
+
+        const auto fileChecksum =
+            Checksum::hash(fileChecksumType(), xml.data(), xml.size());
+        xml.replace(xml.find(placeholder), placeholder.size(), fileChecksum);
+        return xml;
+    }
+
+    /**
+        Streaming variant of to_xml() for large bmaps. The document is
+        generated twice, once to calculate BmapFileChecksum and once into
+        `stream`, so it is never held in memory as a whole.
+    */
+    void write_xml(std::ostream &stream) const {
+        Checksum fileChecksum(fileChecksumType());
+        {
+            detail::XmlWriter out([&](const char *data, size_t len) {
+                fileChecksum.update(data, len);
+            });
+            serialize(out, std::string(Sha256::DIGEST_SIZE * 2, '0'));
+            out.flush();
+        }
+        detail::XmlWriter out(
+            [&](const char *data, size_t len) { stream.write(data, len); });
+        serialize(out, fileChecksum.hexdigest());
+        out.flush();
+    }
+
+    void save(const std::string &xmlPath) const {
+        std::ofstream file(xmlPath, std::ios::out | std::ios::trunc |
+                                        std::ios::binary);
+        write_xml(file);
+        file.flush();
+        if (!file) {
+            throw std::runtime_error(
+                std::format("Unable to write bmap file {}", xmlPath));
+        }
+    }
+
+#ifdef BMAP_DEBUG_PRINT
+    void print() const {
+        std::cout << "Bmap: \n"
+                  << "  imageSize: " << imageSize << "\n"
+                  << "  blockSize: " << blockSize << "\n"
+                  << "  blocks: " << blocksCount << "\n"
+                  << "  mappedBlocks: " << mappedBlocksCount << "\n"
+                  << "  checksumType: " << checksumType << "\n"
+                  << "  checksum: " << checksum << "\n"
+                  << "  BlockMap: \n";
+
         for (const auto range : blockMap) {
             std::cout << "   Range:"
                          "    offset: "
@@ -221,6 +1411,71 @@ struct BmapFile {
         std::cout << std::endl;
     }
 #endif
+
+  private:
+    // bmaptools hashes the file with the range checksum type
+    std::string_view fileChecksumType() const {
+        return checksumType == "blake3" ? "blake3" : "sha256";
+    }
+
+    /**
+        Checks BmapFileChecksum against the document the bmap was parsed
+        from, hashed with the checksum value replaced by zeroes like
+        bmaptools does. Bmaps hashed with a type this library doesn't
+        implement (sha1, md5) are accepted unchecked.
+    */
+    void verifyFileChecksum(std::string_view document) const {
+        if (checksum.empty() || !Checksum::supported(checksumType))
+            return;
+        const auto tag = document.find("<BmapFileChecksum");
+        const auto value = tag == std::string_view::npos
+                               ? tag
+                               : document.find(checksum, tag);
+        if (value == std::string_view::npos) {
+            throw std::runtime_error("BmapFileChecksum not found in the bmap");
+        }
+
+        Checksum hash(fileChecksumType());
+        hash.update(document.data(), value);
+        const auto zeroes = std::string(checksum.size(), '0');
+        hash.update(zeroes.data(), zeroes.size());
+        const auto rest = value + checksum.size();
+        hash.update(document.data() + rest, document.size() - rest);
+        const auto calculated = hash.hexdigest();
+        if (calculated != checksum) {
+            throw std::runtime_error(std::format(
+                "bmap file checksum mismatch: expected {} got {}", checksum,
+                calculated));
+        }
+    }
+
+    template <typename Writer>
+    void serialize(Writer &out, std::string_view fileChecksum) const {
+        out << "<?xml version=\"1.0\" ?>\n"
+            << "<bmap version=\"2.0\">\n"
+            << "    <ImageSize> " << imageSize << " </ImageSize>\n"
+            << "    <BlockSize> " << blockSize << " </BlockSize>\n"
+            << "    <BlocksCount> " << blocksCount << " </BlocksCount>\n"
+            << "    <MappedBlocksCount> " << mappedBlocksCount
+            << " </MappedBlocksCount>\n"
+            << "    <ChecksumType> " << checksumType << " </ChecksumType>\n"
+            << "    <BmapFileChecksum> " << fileChecksum
+            << " </BmapFileChecksum>\n"
+            << "    <BlockMap>\n";
+        for (const auto &range : blockMap) {
+            if (range.checksum.empty()) {
+                out << "        <Range> ";
+            } else {
+                out << "        <Range chksum=\"" << range.checksum << "\"> ";
+            }
+            out << range.offset;
+            if (range.blockCount > 1)
+                out << "-" << range.offset + range.blockCount - 1;
+            out << " </Range>\n";
+        }
+        out << "    </BlockMap>\n"
+            << "</bmap>\n";
+    }
 };
 
 struct Progress {
@@ -234,102 +1489,1237 @@ struct Progress {
 
 typedef std::function<void(const Progress &)> ProgressCallback;
 
-inline void copy(const std::string &wicPath, const std::string &targetDisk,
-                 const ProgressCallback &callback = nullptr) {
-    if (!wicPath.ends_with(".wic") && !wicPath.ends_with("wic.gz")) {
-        throw std::runtime_error(
-            std::format("Expected '.wic' or '.wic.gz' got '{}'", wicPath));
+/**
+    Flight recorder for copy jobs: a preallocated ring of the last
+    `capacity` events (reads, decompression, hashing, writes, syncs and
+    stalls) with their thread, time, offset and size. Recording claims a
+    slot with one atomic increment and never locks or allocates, so it can
+    stay on in production. save() writes Chrome trace JSON, which
+    chrome://tracing and ui.perfetto.dev open.
+
+    copy() records into `CopyOptions::trace`. Sources record through
+    active(), which points at the recorder of the running copy.
+*/
+class TraceRecorder {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Event : uint8_t {
+        Read,
+        ReadStall,
+        Decompress,
+        Hash,
+        WriteSubmit,
+        Write,
+        Zero,
+        Sync,
+    };
+
+    explicit TraceRecorder(size_t capacity = 64 * 1024)
+        : slots(std::bit_ceil(std::max<size_t>(capacity, 2))),
+          origin(Clock::now()) {}
+
+    void record(Event event, Clock::time_point start, Clock::time_point end,
+                size_t offset, size_t bytes) {
+        const auto idx = head.fetch_add(1, std::memory_order_relaxed);
+        auto &slot = slots[idx & (slots.size() - 1)];
+        slot.seq.store(0, std::memory_order_relaxed);
+        slot.event = event;
+        slot.thread = threadId();
+        slot.start = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         start - origin)
+                         .count();
+        slot.end = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       end - origin)
+                       .count();
+        slot.offset = offset;
+        slot.bytes = bytes;
+        // readers only take slots whose sequence matches their index
+        slot.seq.store(idx + 1, std::memory_order_release);
     }
 
-    // todo: support wic.gz
-    if (wicPath.ends_with("wic.gz")) {
-        throw std::runtime_error("Compressed wic files are currently not supported :(");
+    // events recorded so far, including those overwritten since
+    size_t recorded() const { return head.load(std::memory_order_relaxed); }
+
+    /**
+        Writes the events still in the ring as Chrome trace JSON. Call it
+        when no copy records anymore, e.g. after copy() returned or threw.
+    */
+    void write_json(std::ostream &out) const {
+        static constexpr std::string_view NAMES[] = {
+            "read", "read stall", "decompress", "hash",
+            "write submit", "write", "zero", "sync"};
+        const auto end = recorded();
+        const auto begin = end > slots.size() ? end - slots.size() : 0;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        for (auto idx = begin; idx < end; idx++) {
+            const auto &slot = slots[idx & (slots.size() - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != idx + 1)
+                continue;
+            // instants have no duration, complete events ("X") have one
+            const auto instant = slot.start == slot.end;
+            out << (first ? "\n" : ",\n") << "{\"name\":\""
+                << NAMES[size_t(slot.event)] << "\",\"ph\":\""
+                << (instant ? "i" : "X") << "\",\"pid\":1,\"tid\":"
+                << slot.thread << ",\"ts\":" << slot.start / 1000.0;
+            if (instant) {
+                out << ",\"s\":\"t\"";
+            } else {
+                out << ",\"dur\":" << (slot.end - slot.start) / 1000.0;
+            }
+            out << ",\"args\":{\"offset\":" << slot.offset
+                << ",\"bytes\":" << slot.bytes << "}}";
+            first = false;
+        }
+        out << "\n]}\n";
     }
 
-    if (!std::filesystem::exists(wicPath)) {
-        throw std::runtime_error("wic file not found");
+    void save(const std::string &path) const {
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        write_json(file);
+        file.flush();
+        if (!file) {
+            throw std::runtime_error(
+                std::format("Unable to write trace {}", path));
+        }
     }
-    if (!std::filesystem::exists(targetDisk)) {
-        throw std::runtime_error("target disk not found");
+
+    static TraceRecorder *active() {
+        return activeRecorder().load(std::memory_order_relaxed);
     }
 
-    const auto wicfilepath = std::filesystem::path(wicPath);
-    // const auto wicfileWithoutStem =
-    //     std::string(wicPath).replace(wicPath.size() - 4, 4, "");
-    const auto bmapFilePath =
-        wicfilepath.parent_path() / std::format("{}.bmap", wicPath);
+    // makes `recorder` the active one for its lifetime
+    class Scope {
+      public:
+        explicit Scope(TraceRecorder *recorder)
+            : previous(activeRecorder().exchange(recorder)) {}
+        ~Scope() { activeRecorder().store(previous); }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
 
-#ifdef BMAP_COPY_DEBUG_PRINT
-    std::cout << "Found .bmap file: " << bmapFilePath << std::endl;
-#endif
+      private:
+        TraceRecorder *previous;
+    };
 
-    const auto bmapFile = BmapFile::from_xml(bmapFilePath);
+  private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        Event event{};
+        uint32_t thread = 0;
+        int64_t start = 0;
+        int64_t end = 0;
+        uint64_t offset = 0;
+        uint64_t bytes = 0;
+    };
 
-    // todo: validate checksum
+    static std::atomic<TraceRecorder *> &activeRecorder() {
+        static std::atomic<TraceRecorder *> recorder{nullptr};
+        return recorder;
+    }
 
-#ifdef BMAP_COPY_DEBUG_PRINT
-    std::cout << "Image Size: " << bmapFile.imageSize << " Blocks" << std::endl;
-#endif
+    // small, stable thread numbers give one track per thread
+    static uint32_t threadId() {
+        static std::atomic<uint32_t> next{1};
+        thread_local const uint32_t id = next++;
+        return id;
+    }
 
-    auto progress = Progress{bmapFile.mappedBlocksCount, 0};
+    std::vector<Slot> slots;
+    std::atomic<size_t> head{0};
+    const Clock::time_point origin;
+};
 
-    std::ifstream wicFile(wicfilepath, std::ios::in | std::ios::binary);
+namespace detail {
 
-    // std::ofstream blockDevice(targetDisk, std::ios::out | std::ios::binary);
-    auto blockDevice = std::fopen(targetDisk.c_str(), "w+b");
-    if (blockDevice == nullptr) {
-        throw std::runtime_error(
-            std::format("Unable to open block device {} for writing. Maybe "
-                        "missing permissions?",
-                        targetDisk));
+// records the lifetime of the span, costs one load if nothing records
+class TraceSpan {
+  public:
+    TraceSpan(TraceRecorder::Event event, size_t offset, size_t bytes = 0)
+        : bytes(bytes), recorder(TraceRecorder::active()), event(event),
+          offset(offset),
+          start(recorder ? TraceRecorder::Clock::now()
+                         : TraceRecorder::Clock::time_point()) {}
+
+    ~TraceSpan() {
+        if (recorder)
+            recorder->record(event, start, TraceRecorder::Clock::now(), offset,
+                             bytes);
     }
 
-    const auto blockFd = fileno(blockDevice);
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
 
-    std::vector<uint8_t> buff(
-        std::min(bmapFile.blockSize * 1024 * 2, MAX_BUF_SIZE));
-    char *const buffPtrChar = reinterpret_cast<char *>(buff.data());
-    const auto bufferMaxBlocks = buff.size() / bmapFile.blockSize;
-    for (const auto &range : bmapFile.blockMap) {
-        if (range.offset > progress.blocksWritten) {
-            const auto seekOffs = range.offset - progress.blocksWritten;
-            // move outp if not aligned with range
-            std::fseek(blockDevice, seekOffs, SEEK_CUR);
-            wicFile.seekg(seekOffs, std::ios_base::cur); // same for inp
+    // for spans that only learn their size at the end
+    size_t bytes;
+
+  private:
+    TraceRecorder *recorder;
+    TraceRecorder::Event event;
+    size_t offset;
+    TraceRecorder::Clock::time_point start;
+};
+
+} // namespace detail
+
+// buffers of the copy engine, aligned for direct I/O
+using IoBuffer = std::vector<uint8_t, detail::AlignedAllocator<uint8_t, IO_ALIGNMENT>>;
+
+/**
+    Image data the copy engine reads from.
+*/
+class Source {
+  public:
+    virtual ~Source() = default;
+
+    /**
+        Reads up to `len` bytes of image content starting at byte `offset`.
+        Returns the number of bytes read, which is only less than `len` at
+        the end of the image.
+    */
+    virtual size_t read(size_t offset, uint8_t *buf, size_t len) = 0;
+
+    // true if read() may be called from several threads at once. Otherwise
+    // the read-ahead stage uses a single reader thread and reads in order
+    virtual bool concurrentReads() const { return false; }
+};
+
+/**
+    Volatile write cache of a block device as the kernel reports it in
+    /sys/block/<disk>/queue.
+*/
+struct WriteCache {
+    enum class Mode {
+        // not a block device, or sysfs doesn't say
+        Unknown,
+        // no volatile cache, a completed write is on stable storage
+        WriteThrough,
+        // completed writes may sit in the cache until it is flushed
+        WriteBack,
+    };
+    Mode mode = Mode::Unknown;
+    // the device supports FUA writes, RWF_DSYNC writes then don't flush the
+    // whole cache
+    bool fua = false;
+
+    // the cache of the block device `fd` refers to. Partitions report the
+    // cache of their disk
+    static WriteCache detect(int fd) {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode))
+            return {};
+        auto dev = std::filesystem::path(
+            std::format("/sys/dev/block/{}:{}", std::to_string(major(st.st_rdev)),
+                        std::to_string(minor(st.st_rdev))));
+        std::error_code err;
+        if (std::filesystem::exists(dev / "partition", err))
+            dev /= "..";
+
+        WriteCache cache;
+        std::ifstream modeFile(dev / "queue/write_cache");
+        std::string mode;
+        std::getline(modeFile, mode);
+        if (mode == "write back") {
+            cache.mode = Mode::WriteBack;
+        } else if (mode == "write through") {
+            cache.mode = Mode::WriteThrough;
+        }
+        std::ifstream fuaFile(dev / "queue/fua");
+        int fua = 0;
+        cache.fua = (fuaFile >> fua) && fua == 1;
+        return cache;
+    }
+};
+
+/**
+    Target the copy engine writes to.
+*/
+class Sink {
+  public:
+    virtual ~Sink() = default;
+
+    // with a queue depth > 1 this is called from several threads at once,
+    // always for distinct regions
+    virtual void write(size_t offset, const uint8_t *buf, size_t len) = 0;
+
+    // make everything written so far durable
+    virtual void sync() = 0;
+
+    // the target's write cache, CopyOptions::FlushMode::Auto decides by it
+    virtual WriteCache writeCache() const { return {}; }
+
+    // like write(), but the data and everything written and completed
+    // before is durable when it returns. Sinks that can do that for a single
+    // write (RWF_DSYNC) override this, the default syncs the whole target
+    virtual void writeDurable(size_t offset, const uint8_t *buf, size_t len) {
+        write(offset, buf, len);
+        sync();
+    }
+
+    // Sets the region to zero. Sinks override this if they can do it
+    // cheaper than writing zeroes, same threading rules as write().
+    virtual void zero(size_t offset, size_t len) {
+        static const std::vector<uint8_t> zeroes(1024 * 1024);
+        for (size_t done = 0; done < len;) {
+            const auto count = std::min(zeroes.size(), len - done);
+            write(offset + done, zeroes.data(), count);
+            done += count;
+        }
+    }
+};
+
+class FileSource : public Source {
+  public:
+    explicit FileSource(const std::string &path)
+        : file(::open(path.c_str(), O_RDONLY)) {
+        if (file.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open image {}: {}", path, strerror(errno)));
+        }
+    }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        return detail::readAt(file.get(), offset, buf, len);
+    }
+
+    bool concurrentReads() const override { return true; }
+
+  private:
+    detail::FileDescriptor file;
+};
+
+struct CopyOptions;
+
+class FileSink : public Sink {
+  public:
+    enum class Mode {
+        // through the page cache
+        Buffered,
+        // O_DIRECT for aligned writes of at least `directMinSize` bytes,
+        // unaligned ones (e.g. a partial last block) and smaller ones go
+        // through a second, buffered descriptor
+        Direct,
+    };
+
+    // the target is not truncated, blocks outside of the bmap stay untouched
+    explicit FileSink(const std::string &path, Mode mode = Mode::Buffered,
+                      size_t directMinSize = 0)
+        : directMinSize(directMinSize), file(::open(path.c_str(), O_WRONLY)),
+          direct(mode == Mode::Direct ? ::open(path.c_str(), O_WRONLY | O_DIRECT)
+                                      : -1) {
+        if (file.get() < 0) {
+            throw std::runtime_error(
+                std::format("Unable to open block device {} for writing. Maybe "
+                            "missing permissions?",
+                            path));
+        }
+        if (mode == Mode::Direct && direct.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open {} with O_DIRECT: {}", path, strerror(errno)));
+        }
+    }
+
+    // opens the target the way `options` asks for
+    FileSink(const std::string &path, const CopyOptions &options);
+
+    /**
+        Both descriptors refer to the same file and the writes of a copy
+        never overlap, so mixing them is safe: O_DIRECT writes invalidate
+        cached pages of their region, and sync() flushes both before a
+        range counts as durable.
+    */
+    void write(size_t offset, const uint8_t *buf, size_t len) override {
+        writeWith(offset, buf, len, 0);
+    }
+
+    /**
+        RWF_DSYNC write. On a block device the kernel sends it with FUA, or
+        follows it with a cache flush if the device has no FUA; only the
+        flush also covers earlier writes still in the device cache, see
+        CopyOptions::FlushMode::Fua.
+    */
+    void writeDurable(size_t offset, const uint8_t *buf, size_t len) override {
+        writeWith(offset, buf, len, RWF_DSYNC);
+    }
+
+    void sync() override {
+        if (::fsync(file.get()) != 0 ||
+            (direct.get() >= 0 && ::fsync(direct.get()) != 0)) {
+            throw std::runtime_error(
+                std::format("fsync failed: {}", std::string(strerror(errno))));
         }
+    }
+
+    WriteCache writeCache() const override {
+        return WriteCache::detect(file.get());
+    }
+
+    // BLKZEROOUT on block devices, FALLOC_FL_ZERO_RANGE on files. Both let
+    // the device/filesystem zero without transferring the data
+    void zero(size_t offset, size_t len) override {
+        struct stat st;
+        if (::fstat(file.get(), &st) == 0 && S_ISBLK(st.st_mode)) {
+            uint64_t range[2] = {offset, len};
+            if (::ioctl(file.get(), BLKZEROOUT, &range) == 0)
+                return;
+        } else if (::fallocate(file.get(), FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                               offset, len) == 0) {
+            return;
+        }
+        Sink::zero(offset, len);
+    }
+
+  private:
+    void writeWith(size_t offset, const uint8_t *buf, size_t len, int flags) {
+        if (direct.get() >= 0 && len >= directMinSize &&
+            offset % IO_ALIGNMENT == 0 && len % IO_ALIGNMENT == 0 &&
+            reinterpret_cast<uintptr_t>(buf) % IO_ALIGNMENT == 0) {
+            detail::writeAt(direct.get(), offset, buf, len, flags);
+        } else {
+            detail::writeAt(file.get(), offset, buf, len, flags);
+        }
+    }
+
+    const size_t directMinSize;
+    detail::FileDescriptor file;
+    detail::FileDescriptor direct;
+};
+
+struct CopyOptions {
+    // writes in flight. Without `adaptive` this is fixed, otherwise it is
+    // the starting point of the controller
+    size_t queueDepth = 1;
+    // bytes per I/O, rounded down to whole blocks
+    size_t ioSize = MAX_BUF_SIZE;
+
+    // tune queueDepth and ioSize while copying from the measured completion
+    // latency and throughput, bounded by the limits below
+    bool adaptive = false;
+    size_t maxQueueDepth = 64;
+    size_t minIoSize = 64 * 1024;
+    size_t maxIoSize = MAX_BUF_SIZE;
+
+    // bypass the page cache when copy opens the target itself
+    bool directIo = false;
+    // with directIo, aligned writes smaller than this still go through the
+    // page cache. Small ranges then cost no O_DIRECT round trip each while
+    // large ones bypass the cache. 0 writes everything aligned direct
+    size_t directMinSize = 0;
+
+    enum class ZeroChunks {
+        // write all-zero chunks like any other data
+        Write,
+        // turn all-zero chunks into Sink::zero (BLKZEROOUT)
+        ZeroOut,
+        // don't touch all-zero chunks at all. Only correct if the target is
+        // known to read back as zero, e.g. after a discard with guaranteed
+        // zeroing or on a freshly created sparse file
+        Skip,
+    };
+    ZeroChunks zeroChunks = ZeroChunks::Write;
+
+    // verify the range checksums of the bmap against the data read
+    bool verifyChecksums = true;
+
+    /**
+        When copy makes the written data durable. Flushing a device with a
+        volatile write cache empties the whole cache, so fewer flushes are
+        faster; the modes differ in what survives a power loss during the
+        copy. The data is durable when copy returns in every mode.
+    */
+    enum class FlushMode {
+        // by the target's WriteCache: Fua for write-through devices written
+        // with direct I/O only, End for write-back devices with directIo,
+        // Periodic for other block devices and Range for files and sinks
+        // that report no cache
+        Auto,
+        // fsync after every range: all ranges written so far are durable
+        Range,
+        // fsync once `flushInterval` bytes were written since the last one,
+        // also within a range: at most that much is lost, and the page
+        // cache never holds more dirty data than that
+        Periodic,
+        // a single fsync at the end: nothing is durable before copy returns
+        End,
+        // instead of an fsync, the last chunk of each range is written with
+        // RWF_DSYNC once the other chunks of the range completed: a range
+        // is durable when its last chunk is. That only covers the earlier
+        // chunks if they bypassed the page cache (directIo, directMinSize
+        // 0) and the device either has no volatile cache or no FUA, so
+        // the kernel follows the write with a cache flush. Elsewhere copy
+        // uses Range
+        Fua,
+    };
+    FlushMode flushMode = FlushMode::Auto;
+    size_t flushInterval = 256 * 1024 * 1024;
+
+    // chunks read ahead of the writer by `readThreads` threads, hides the
+    // latency of slow sources (NFS, USB drives). 0 reads inline
+    size_t readAhead = 0;
+    size_t readThreads = 4;
+
+    // records the events of the copy when set, see TraceRecorder
+    TraceRecorder *trace = nullptr;
+};
+
+inline FileSink::FileSink(const std::string &path, const CopyOptions &options)
+    : FileSink(path, options.directIo ? Mode::Direct : Mode::Buffered,
+               options.directMinSize) {}
+
+struct CopyStats {
+    // including zeroed bytes
+    size_t bytesWritten = 0;
+    // all-zero chunks, see CopyOptions::zeroChunks
+    size_t bytesZeroed = 0;
+    size_t bytesSkipped = 0;
+    double seconds = 0;
+    // chunks the writer had to wait for because the source was not fast
+    // enough, and the time spent waiting
+    size_t chunks = 0;
+    size_t readStalls = 0;
+    double readStallSeconds = 0;
+    // settings in use at the end of the copy, with `adaptive` the values the
+    // controller converged to
+    size_t queueDepth = 0;
+    size_t ioSize = 0;
+    double avgLatencyMs = 0;
+    // the flush mode used (never Auto) and the time spent in fsync
+    CopyOptions::FlushMode flushMode = CopyOptions::FlushMode::Range;
+    size_t syncs = 0;
+    double syncSeconds = 0;
+    // RWF_DSYNC writes of FlushMode::Fua
+    size_t durableWrites = 0;
+
+    double throughput() const { return seconds > 0 ? bytesWritten / seconds : 0; }
+};
+
+namespace detail {
+
+/**
+    Controller for queue depth and I/O size. Completions are collected into
+    windows, after each window:
+      - throughput went up noticeably: increase, alternating between one
+        more I/O in flight (additive) and doubling the I/O size
+        (multiplicative, so a 64 KiB start reaches 8 MiB in seven steps)
+      - latency per byte went up without a throughput gain (the device
+        queue is saturated): halve the queue depth, or the I/O size once the
+        depth is at 1
+      - otherwise keep the settings, the controller has converged
+*/
+class AdaptiveController {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    AdaptiveController(const CopyOptions &options, size_t blockSize)
+        : options(options), blockSize(blockSize),
+          depth(std::clamp<size_t>(options.queueDepth, 1,
+                                   options.adaptive ? options.maxQueueDepth
+                                                    : options.queueDepth)),
+          io(alignDown(options.ioSize)), windowStart(Clock::now()) {}
+
+    size_t queueDepth() const { return depth; }
+    size_t ioSize() const { return io; }
+
+    void completed(size_t bytes, Clock::duration latency) {
+        const auto latencyNs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(latency)
+                .count();
+        totalLatencyNs += latencyNs;
+        totalCompletions++;
+        if (!options.adaptive)
+            return;
+
+        windowBytes += bytes;
+        windowLatencyNs += latencyNs;
+        windowCompletions++;
 
-        for (auto blockCount = range.blockCount; blockCount > 0;) {
-            const auto readBlocks =
-                bufferMaxBlocks < blockCount ? bufferMaxBlocks : blockCount;
-            const auto byteCount = readBlocks * bmapFile.blockSize;
-            wicFile.read(buffPtrChar, byteCount);
-            // blockDevice.write(buffPtrChar, byteCount);
-            std::fwrite(buff.data(), sizeof(uint8_t), byteCount, blockDevice);
+        const auto now = Clock::now();
+        const auto elapsed = std::chrono::duration<double>(now - windowStart);
+        if (windowCompletions < 2 * depth || elapsed.count() < WINDOW_SECONDS)
+            return;
 
-            progress.blocksWritten += readBlocks;
+        const auto throughput = windowBytes / elapsed.count();
+        const auto nsPerByte = double(windowLatencyNs) / windowBytes;
+        minNsPerByte = std::min(minNsPerByte, nsPerByte);
+
+        if (throughput > bestThroughput * 1.05) {
+            bestThroughput = throughput;
+            increase();
+        } else if (nsPerByte > minNsPerByte * 2) {
+            decrease();
+            // the plateau moved, measure it again
+            bestThroughput = throughput;
+        }
+
+        windowStart = now;
+        windowBytes = 0;
+        windowLatencyNs = 0;
+        windowCompletions = 0;
+    }
+
+    double avgLatencyMs() const {
+        return totalCompletions ? totalLatencyNs / 1e6 / totalCompletions : 0;
+    }
+
+  private:
+    static constexpr double WINDOW_SECONDS = 0.05;
+
+    size_t alignDown(size_t bytes) const {
+        return std::max(blockSize, bytes / blockSize * blockSize);
+    }
+
+    void increase() {
+        const bool growIo = (growIoNext && io < options.maxIoSize) ||
+                            depth >= options.maxQueueDepth;
+        if (growIo) {
+            io = alignDown(std::min(io * 2, options.maxIoSize));
+        } else {
+            depth = std::min(depth + 1, options.maxQueueDepth);
+        }
+        growIoNext = !growIoNext;
+    }
+
+    void decrease() {
+        if (depth > 1) {
+            depth = std::max<size_t>(1, depth / 2);
+        } else {
+            io = alignDown(std::max(io / 2, options.minIoSize));
+        }
+    }
+
+    const CopyOptions options;
+    const size_t blockSize;
+    size_t depth;
+    size_t io;
+    bool growIoNext = false;
+
+    Clock::time_point windowStart;
+    size_t windowBytes = 0;
+    int64_t windowLatencyNs = 0;
+    size_t windowCompletions = 0;
+    double bestThroughput = 0;
+    double minNsPerByte = std::numeric_limits<double>::max();
+
+    int64_t totalLatencyNs = 0;
+    size_t totalCompletions = 0;
+};
+
+/**
+    Runs sink writes on a pool of worker threads, one per possible in-flight
+    write. Completions are handed back to the submitting thread.
+*/
+class WriteQueue {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Completion {
+        size_t bytes;
+        size_t blocks;
+        bool zero;
+        Clock::duration latency;
+        IoBuffer buffer;
+    };
+
+    WriteQueue(Sink &sink, size_t workers) : sink(sink) {
+        for (size_t i = 0; i < workers; i++)
+            threads.emplace_back([this]() { run(); });
+    }
+
+    ~WriteQueue() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        jobCv.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    // with `zero` the buffer content is not used, the region is zeroed.
+    // `durable` writes with Sink::writeDurable
+    void submit(size_t offset, IoBuffer buffer, size_t bytes, size_t blocks,
+                bool zero = false, bool durable = false) {
+        if (const auto trace = TraceRecorder::active()) {
+            const auto now = TraceRecorder::Clock::now();
+            trace->record(TraceRecorder::Event::WriteSubmit, now, now, offset,
+                          bytes);
+        }
+        {
+            std::lock_guard lock(mutex);
+            jobs.push_back(
+                Job{offset, bytes, blocks, zero, durable, std::move(buffer)});
+            inFlight++;
+        }
+        jobCv.notify_one();
+    }
+
+    size_t pending() const { return inFlight; }
+
+    // blocks until at least one write completed, rethrows write errors
+    std::vector<Completion> reap() {
+        std::unique_lock lock(mutex);
+        doneCv.wait(lock, [this]() { return !done.empty() || error; });
+        if (error)
+            std::rethrow_exception(error);
+        auto res = std::move(done);
+        done.clear();
+        inFlight -= res.size();
+        return res;
+    }
+
+  private:
+    struct Job {
+        size_t offset;
+        size_t bytes;
+        size_t blocks;
+        bool zero;
+        bool durable;
+        IoBuffer buffer;
+    };
+
+    void run() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock lock(mutex);
+                jobCv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            const auto start = Clock::now();
+            try {
+                detail::TraceSpan span(job.zero ? TraceRecorder::Event::Zero
+                                                : TraceRecorder::Event::Write,
+                                       job.offset, job.bytes);
+                if (job.zero) {
+                    sink.zero(job.offset, job.bytes);
+                } else if (job.durable) {
+                    sink.writeDurable(job.offset, job.buffer.data(), job.bytes);
+                } else {
+                    sink.write(job.offset, job.buffer.data(), job.bytes);
+                }
+            } catch (...) {
+                std::lock_guard lock(mutex);
+                error = std::current_exception();
+                doneCv.notify_all();
+                continue;
+            }
+            const auto latency = Clock::now() - start;
+
+            {
+                std::lock_guard lock(mutex);
+                done.push_back(Completion{job.bytes, job.blocks, job.zero,
+                                          latency, std::move(job.buffer)});
+            }
+            doneCv.notify_all();
+        }
+    }
+
+    Sink &sink;
+    std::mutex mutex;
+    std::condition_variable jobCv;
+    std::condition_variable doneCv;
+    std::deque<Job> jobs;
+    std::vector<Completion> done;
+    size_t inFlight = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+};
+
+/**
+    Splits the ranges of a bmap into chunks of the current I/O size, in the
+    order they are written.
+*/
+class ChunkPlanner {
+  public:
+    struct Chunk {
+        size_t range;
+        size_t offset;
+        size_t bytes;
+        size_t blocks;
+        // the range is complete after this chunk
+        bool last;
+    };
+
+    explicit ChunkPlanner(const BmapFile &bmapFile) : bmapFile(bmapFile) {}
+
+    bool next(size_t ioSize, Chunk &chunk) {
+        while (range < bmapFile.blockMap.size() &&
+               bmapFile.blockMap[range].blockCount == 0) {
+            range++;
+        }
+        if (range >= bmapFile.blockMap.size())
+            return false;
+
+        const auto &current = bmapFile.blockMap[range];
+        const auto maxBlocks = std::max<size_t>(1, ioSize / bmapFile.blockSize);
+        const auto blocks = std::min(maxBlocks, current.blockCount - done);
+        chunk = Chunk{range, (current.offset + done) * bmapFile.blockSize,
+                      blocks * bmapFile.blockSize, blocks,
+                      done + blocks == current.blockCount};
+        done += blocks;
+        if (chunk.last) {
+            range++;
+            done = 0;
+        }
+        return true;
+    }
+
+  private:
+    const BmapFile &bmapFile;
+    size_t range = 0;
+    size_t done = 0;
+};
+
+/**
+    Read stage of the copy engine. Chunks are queued in write order, reader
+    threads fill them in the background and pop() hands them out in the same
+    order. Without threads the read happens in push().
+*/
+class ReadAhead {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Read {
+        ChunkPlanner::Chunk chunk{};
+        IoBuffer buffer;
+        size_t bytesRead = 0;
+        bool done = false;
+        bool taken = false;
+        std::exception_ptr error;
+    };
+
+    ReadAhead(Source &source, size_t threads) : source(source) {
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    ~ReadAhead() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    void push(const ChunkPlanner::Chunk &chunk, IoBuffer buffer) {
+        buffer.resize(chunk.bytes);
+        if (workers.empty()) {
+            Read read;
+            read.chunk = chunk;
+            read.buffer = std::move(buffer);
+            detail::TraceSpan span(TraceRecorder::Event::Read, chunk.offset,
+                                   chunk.bytes);
+            // the last block of the image may be partial
+            read.bytesRead = source.read(chunk.offset, read.buffer.data(),
+                                         chunk.bytes);
+            read.done = true;
+            reads.push_back(std::move(read));
+            return;
+        }
+        {
+            std::lock_guard lock(mutex);
+            auto &read = reads.emplace_back();
+            read.chunk = chunk;
+            read.buffer = std::move(buffer);
+        }
+        cv.notify_one();
+    }
+
+    size_t size() const { return reads.size(); }
+
+    Read pop() {
+        std::unique_lock lock(mutex);
+        if (!reads.front().done) {
+            detail::TraceSpan span(TraceRecorder::Event::ReadStall,
+                                   reads.front().chunk.offset,
+                                   reads.front().chunk.bytes);
+            const auto start = Clock::now();
+            cv.wait(lock, [this]() { return reads.front().done; });
+            stalls++;
+            stallTime += Clock::now() - start;
+        }
+        auto read = std::move(reads.front());
+        reads.pop_front();
+        if (read.error)
+            std::rethrow_exception(read.error);
+        return read;
+    }
+
+    size_t stalls = 0;
+    Clock::duration stallTime{};
+
+  private:
+    void run() {
+        for (;;) {
+            Read *read = nullptr;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&]() {
+                    if (stopping)
+                        return true;
+                    for (auto &pending : reads) {
+                        if (!pending.taken) {
+                            read = &pending;
+                            return true;
+                        }
+                    }
+                    return false;
+                });
+                if (stopping)
+                    return;
+                read->taken = true;
+            }
+
+            size_t bytesRead = 0;
+            std::exception_ptr error;
+            try {
+                detail::TraceSpan span(TraceRecorder::Event::Read,
+                                       read->chunk.offset, read->chunk.bytes);
+                bytesRead = source.read(read->chunk.offset,
+                                        read->buffer.data(), read->chunk.bytes);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard lock(mutex);
+                read->bytesRead = bytesRead;
+                read->error = error;
+                read->done = true;
+            }
+            cv.notify_all();
+        }
+    }
+
+    Source &source;
+    std::mutex mutex;
+    std::condition_variable cv;
+    // std::deque keeps references stable on push_back/pop_front
+    std::deque<Read> reads;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+// resolves FlushMode::Auto for `sink` and checks Fua can be used, see there
+inline CopyOptions::FlushMode flushModeFor(const CopyOptions &options,
+                                           const Sink &sink) {
+    using FlushMode = CopyOptions::FlushMode;
+    if (options.flushMode != FlushMode::Auto &&
+        options.flushMode != FlushMode::Fua)
+        return options.flushMode;
+
+    const auto cache = sink.writeCache();
+    const bool fuaCoversRange =
+        options.directIo && options.directMinSize == 0 &&
+        (cache.mode == WriteCache::Mode::WriteThrough ||
+         (cache.mode == WriteCache::Mode::WriteBack && !cache.fua));
+    if (options.flushMode == FlushMode::Fua)
+        return fuaCoversRange ? FlushMode::Fua : FlushMode::Range;
+
+    switch (cache.mode) {
+    case WriteCache::Mode::WriteThrough:
+        // completed direct writes are durable already, the RWF_DSYNC write
+        // costs nothing extra. Buffered writes still have to leave the
+        // page cache
+        return fuaCoversRange ? FlushMode::Fua : FlushMode::Periodic;
+    case WriteCache::Mode::WriteBack:
+        // every flush empties the whole cache, flush once
+        return options.directIo ? FlushMode::End : FlushMode::Periodic;
+    case WriteCache::Mode::Unknown:
+        break;
+    }
+    return FlushMode::Range;
+}
+
+} // namespace detail
+
+/**
+    Copies the ranges of `bmapFile` from `source` to `sink`. Blocks outside of
+    the ranges are left untouched, which also makes it possible to apply a
+    delta bmap onto a device holding the previous image version.
+
+    Reads happen on the calling thread or, with `readAhead`, on reader
+    threads ahead of the writer. Up to `queueDepth` writes are in flight on
+    worker threads. The target is synced as `flushMode` says, all writes
+    complete before each sync.
+*/
+inline CopyStats copy(Source &source, const BmapFile &bmapFile, Sink &sink,
+                      const ProgressCallback &callback = nullptr,
+                      const CopyOptions &options = {}) {
+#ifdef BMAP_COPY_DEBUG_PRINT
+    std::cout << "Image Size: " << bmapFile.imageSize << " Bytes" << std::endl;
+#endif
+
+    // parsed bmaps are normalized already, built ones may not be
+    if (!bmapFile.normalized()) {
+        auto normalized = bmapFile;
+        normalized.normalize();
+        return copy(source, normalized, sink, callback, options);
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    auto progress = Progress{bmapFile.mappedBlocksCount, 0};
+    CopyStats stats;
+    const TraceRecorder::Scope traceScope(options.trace);
+
+    using FlushMode = CopyOptions::FlushMode;
+    stats.flushMode = detail::flushModeFor(options, sink);
+
+    detail::AdaptiveController controller(options, bmapFile.blockSize);
+    detail::WriteQueue queue(sink, options.adaptive ? options.maxQueueDepth
+                                                    : controller.queueDepth());
+    std::vector<IoBuffer> freeBuffers;
+
+    const auto reap = [&]() {
+        for (auto &completion : queue.reap()) {
+            if (completion.zero) {
+                // offloaded zeroing says nothing about write performance
+                stats.bytesZeroed += completion.bytes;
+            } else {
+                controller.completed(completion.bytes, completion.latency);
+            }
+            stats.bytesWritten += completion.bytes;
+            progress.blocksWritten += completion.blocks;
+            freeBuffers.push_back(std::move(completion.buffer));
 
             if (callback) {
                 callback(progress);
             }
+        }
+    };
+
+    // bytes written since the last sync or durable write
+    size_t unflushed = 0;
+    const auto flush = [&](size_t offset) {
+        while (queue.pending() > 0)
+            reap();
+        const auto start = std::chrono::steady_clock::now();
+        {
+            detail::TraceSpan span(TraceRecorder::Event::Sync, offset);
+            sink.sync();
+        }
+        stats.syncs++;
+        stats.syncSeconds += std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+        unflushed = 0;
+    };
+
+    const bool verify = options.verifyChecksums &&
+                        Checksum::supported(bmapFile.checksumType);
+
+    detail::ChunkPlanner planner(bmapFile);
+    detail::ReadAhead reader(
+        source, options.readAhead == 0 ? 0
+                : source.concurrentReads()
+                    ? std::max<size_t>(1, options.readThreads)
+                    : 1);
+    const auto fill = [&]() {
+        // the chunk being processed counts towards the window
+        for (detail::ChunkPlanner::Chunk chunk;
+             reader.size() < std::max<size_t>(1, options.readAhead) &&
+             planner.next(controller.ioSize(), chunk);) {
+            IoBuffer buff;
+            if (!freeBuffers.empty()) {
+                buff = std::move(freeBuffers.back());
+                freeBuffers.pop_back();
+            }
+            reader.push(chunk, std::move(buff));
+        }
+    };
+
+    Checksum hash(verify ? bmapFile.checksumType : "sha256",
+                  detail::threadCount(0));
+    for (fill(); reader.size() > 0; fill()) {
+        while (queue.pending() >= controller.queueDepth())
+            reap();
+
+        auto read = reader.pop();
+        const auto &chunk = read.chunk;
+        const auto readCount = read.bytesRead;
+        // only the image end may cut a read short, or the end of an image
+        // inside the last block of a range of a manifest
+        const auto expected =
+            chunk.offset < bmapFile.imageSize
+                ? std::min(chunk.bytes, bmapFile.imageSize - chunk.offset)
+                : 0;
+        if (readCount < expected &&
+            (!chunk.last || readCount + bmapFile.blockSize <= expected ||
+             readCount % bmapFile.blockSize == 0)) {
+            throw std::runtime_error(std::format(
+                "Unexpected end of image at offset {}: read {} of {} bytes",
+                std::to_string(chunk.offset), std::to_string(readCount),
+                std::to_string(expected)));
+        }
+        stats.chunks++;
+        if (verify) {
+            detail::TraceSpan span(TraceRecorder::Event::Hash, chunk.offset,
+                                   readCount);
+            hash.update(read.buffer.data(), readCount);
+        }
+
+        if (options.zeroChunks != CopyOptions::ZeroChunks::Write &&
+            detail::isZero(read.buffer.data(), readCount)) {
+            if (options.zeroChunks == CopyOptions::ZeroChunks::Skip) {
+                stats.bytesSkipped += readCount;
+                progress.blocksWritten += chunk.blocks;
+                freeBuffers.push_back(std::move(read.buffer));
+                if (callback) {
+                    callback(progress);
+                }
+            } else {
+                queue.submit(chunk.offset, std::move(read.buffer), readCount,
+                             chunk.blocks, true);
+                unflushed += readCount;
+            }
+        } else if (chunk.last && stats.flushMode == FlushMode::Fua) {
+            // the durable write has to come after the rest of the range
+            while (queue.pending() > 0)
+                reap();
+            queue.submit(chunk.offset, std::move(read.buffer), readCount,
+                         chunk.blocks, false, true);
+            stats.durableWrites++;
+            unflushed = 0;
+        } else {
+            queue.submit(chunk.offset, std::move(read.buffer), readCount,
+                         chunk.blocks);
+            unflushed += readCount;
+        }
+
+        if (stats.flushMode == FlushMode::Periodic &&
+            unflushed >= options.flushInterval)
+            flush(chunk.offset);
+
+        if (!chunk.last)
+            continue;
 
-            blockCount -= readBlocks;
+        // zeroed or skipped last chunks of Fua ranges need the sync
+        if (stats.flushMode == FlushMode::Range ||
+            (stats.flushMode == FlushMode::Fua && unflushed > 0))
+            flush(chunk.offset);
+
+        const auto &range = bmapFile.blockMap[chunk.range];
+        if (verify && !range.checksum.empty()) {
+            const auto checksum = hash.hexdigest();
+            if (checksum != range.checksum) {
+                throw std::runtime_error(std::format(
+                    "Checksum mismatch for range {}-{}: expected {} got {}",
+                    std::to_string(range.offset),
+                    std::to_string(range.offset + range.blockCount - 1),
+                    range.checksum, checksum));
+            }
         }
-        fsync(blockFd);
+        hash.reset();
 #ifdef BMAP_COPY_DEBUG_PRINT
         std::cout << "Blocks written: " << progress.blocksWritten
-                  << " (" << progress.percent() << "%)"
+                  << " (" << unsigned(progress.percent()) << "%)"
                   << " Remaining: "
                   << bmapFile.mappedBlocksCount - progress.blocksWritten
                   << std::endl;
 #endif
     }
 
-    std::fclose(blockDevice);
-    wicFile.close();
+    while (queue.pending() > 0)
+        reap();
+    if (unflushed > 0)
+        flush(bmapFile.imageSize);
+
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - startTime)
+                        .count();
+    stats.queueDepth = controller.queueDepth();
+    stats.ioSize = controller.ioSize();
+    stats.avgLatencyMs = controller.avgLatencyMs();
+    if (options.readAhead > 0) {
+        stats.readStalls = reader.stalls;
+        stats.readStallSeconds =
+            std::chrono::duration<double>(reader.stallTime).count();
+    }
+
+#ifdef BMAP_COPY_DEBUG_PRINT
+    std::cout << "Copy done. Queue depth: " << stats.queueDepth
+              << " I/O size: " << stats.ioSize << std::endl;
+#endif
+    return stats;
+}
+
+/**
+    Writes the ranges of `bmapFile` from the image at `wicPath` to
+    `targetDisk`.
+*/
+inline CopyStats copy(const std::string &wicPath, const BmapFile &bmapFile,
+                      const std::string &targetDisk,
+                      const ProgressCallback &callback = nullptr,
+                      const CopyOptions &options = {}) {
+    if (!std::filesystem::exists(wicPath)) {
+        throw std::runtime_error("wic file not found");
+    }
+    if (!std::filesystem::exists(targetDisk)) {
+        throw std::runtime_error("target disk not found");
+    }
+
+    FileSource source(wicPath);
+    FileSink sink(targetDisk, options);
+    return copy(source, bmapFile, sink, callback, options);
+}
+
+/**
+    Same as above but with an explicitly given bmap file, e.g. a delta bmap.
+*/
+inline CopyStats copy(const std::string &wicPath, const std::string &bmapPath,
+                      const std::string &targetDisk,
+                      const ProgressCallback &callback = nullptr,
+                      const CopyOptions &options = {}) {
+    return copy(wicPath, BmapFile::from_xml(bmapPath), targetDisk, callback,
+                options);
+}
+
+/**
+    Path of the bmap next to `imagePath`: `<imagePath>.bmap`, or a compressed
+    `.bmap.gz` (`.bmap.zst`) if there is no plain one.
+*/
+inline std::string find_bmap(const std::string &imagePath) {
+    for (const auto suffix : {".bmap", ".bmap.gz", ".bmap.zst"}) {
+        const auto path = imagePath + suffix;
+        if (std::filesystem::exists(path))
+            return path;
+    }
+    // from_xml reports the plain name as missing
+    return imagePath + ".bmap";
+}
+
+/**
+    Copies `wicPath` to `targetDisk` using the bmap found next to the image
+    (see find_bmap).
+*/
+inline CopyStats copy(const std::string &wicPath, const std::string &targetDisk,
+                      const ProgressCallback &callback = nullptr,
+                      const CopyOptions &options = {}) {
+    if (!wicPath.ends_with(".wic") && !wicPath.ends_with("wic.gz")) {
+        throw std::runtime_error(
+            std::format("Expected '.wic' or '.wic.gz' got '{}'", wicPath));
+    }
+
+    // todo: support wic.gz
+    if (wicPath.ends_with("wic.gz")) {
+        throw std::runtime_error("Compressed wic files are currently not supported :(");
+    }
+
+    const auto bmapFilePath = find_bmap(wicPath);
 
 #ifdef BMAP_COPY_DEBUG_PRINT
-    std::cout << "Copy done." << std::endl;
+    std::cout << "Found .bmap file: " << bmapFilePath << std::endl;
 #endif
+
+    return copy(wicPath, BmapFile::from_xml(bmapFilePath), targetDisk, callback,
+                options);
 }
 
 } // namespace bmap
@@ -0,0 +1,329 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_CACHE_H
+#define BMAP_CACHE_H
+
+#include <map>
+#include <memory>
+#include <optional>
+
+#include <sys/stat.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+/**
+    Local store of range data keyed by the range checksum. Consecutive image
+    releases share most ranges byte for byte; ranges already in the store
+    are read from local storage instead of the (compressed or remote) image.
+
+    Layout: `<dir>/<checksum type>/<first two digest chars>/<digest>`, one
+    file with the raw range data each. Entries are written to a temporary
+    file, verified against the digest and renamed into place, so a crash
+    never leaves a corrupt entry behind.
+*/
+class RangeStore {
+  public:
+    explicit RangeStore(std::filesystem::path dir) : dir(std::move(dir)) {
+        std::filesystem::create_directories(this->dir);
+    }
+
+    /**
+        True if the pair can key an entry: a supported checksum type and a
+        lowercase hex digest of its length. Both come from the bmap, which
+        may not be trusted, and become parts of the entry path; anything
+        else (e.g. "../") is never looked up or stored.
+    */
+    static bool valid(const std::string &checksumType,
+                      const std::string &checksum) {
+        return Checksum::supported(checksumType) &&
+               checksum.size() == Sha256::DIGEST_SIZE * 2 &&
+               std::ranges::all_of(checksum, [](char c) {
+                   return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+               });
+    }
+
+    std::filesystem::path path(const std::string &checksumType,
+                               const std::string &checksum) const {
+        if (!valid(checksumType, checksum)) {
+            throw std::runtime_error(std::format(
+                "Invalid range cache key {}/{}", checksumType, checksum));
+        }
+        return dir / checksumType / checksum.substr(0, 2) / checksum;
+    }
+
+    bool contains(const std::string &checksumType,
+                  const std::string &checksum) const {
+        return valid(checksumType, checksum) &&
+               std::filesystem::exists(path(checksumType, checksum));
+    }
+
+    /**
+        Adds the file at `tmpPath` as entry `checksum` if its content hashes
+        to it. The temporary file is removed either way.
+    */
+    bool commit(const std::filesystem::path &tmpPath,
+                const std::string &checksumType, const std::string &checksum) {
+        const auto ok = valid(checksumType, checksum) &&
+                        hashFile(tmpPath, checksumType) == checksum;
+        if (ok) {
+            const auto target = path(checksumType, checksum);
+            std::filesystem::create_directories(target.parent_path());
+            std::filesystem::rename(tmpPath, target);
+        } else {
+            std::filesystem::remove(tmpPath);
+        }
+        return ok;
+    }
+
+    std::filesystem::path tempPath() {
+        const auto tmpDir = dir / "tmp";
+        std::filesystem::create_directories(tmpDir);
+        return tmpDir / std::format("{}-{}", std::to_string(::getpid()),
+                                    std::to_string(nextTemp++));
+    }
+
+    /**
+        Stores all ranges of `imagePath`, e.g. the release currently on the
+        device, so the next update only needs the ranges that changed.
+        Returns the number of ranges added.
+    */
+    size_t import(const std::string &imagePath, const BmapFile &bmapFile) {
+        FileSource source(imagePath);
+        size_t added = 0;
+        std::vector<uint8_t> buff(MAX_BUF_SIZE);
+        for (const auto &range : bmapFile.blockMap) {
+            if (!valid(bmapFile.checksumType, range.checksum) ||
+                contains(bmapFile.checksumType, range.checksum))
+                continue;
+            const auto tmp = tempPath();
+            detail::FileDescriptor out(::open(
+                tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+            if (out.get() < 0) {
+                throw std::runtime_error(
+                    std::format("Unable to create {}", tmp.string()));
+            }
+            const auto start = range.offset * bmapFile.blockSize;
+            const auto end =
+                std::min(bmapFile.imageSize,
+                         (range.offset + range.blockCount) * bmapFile.blockSize);
+            for (auto pos = start; pos < end;) {
+                const auto len =
+                    source.read(pos, buff.data(), std::min(buff.size(), end - pos));
+                if (len == 0)
+                    break;
+                detail::writeAt(out.get(), pos - start, buff.data(), len);
+                pos += len;
+            }
+            added += commit(tmp, bmapFile.checksumType, range.checksum);
+        }
+        return added;
+    }
+
+    /**
+        Removes the least recently used entries until the store holds at
+        most `maxBytes`.
+    */
+    void prune(size_t maxBytes) {
+        std::vector<std::pair<std::filesystem::file_time_type,
+                              std::filesystem::path>>
+            entries;
+        size_t total = 0;
+        for (const auto &entry :
+             std::filesystem::recursive_directory_iterator(dir)) {
+            if (!entry.is_regular_file() ||
+                entry.path().parent_path().filename() == "tmp")
+                continue;
+            total += entry.file_size();
+            entries.emplace_back(entry.last_write_time(), entry.path());
+        }
+        std::sort(entries.begin(), entries.end());
+        for (const auto &[time, entryPath] : entries) {
+            if (total <= maxBytes)
+                break;
+            total -= std::filesystem::file_size(entryPath);
+            std::filesystem::remove(entryPath);
+        }
+    }
+
+    // marks an entry as recently used for prune()
+    void touch(const std::filesystem::path &entryPath) {
+        std::error_code ec;
+        std::filesystem::last_write_time(
+            entryPath, std::filesystem::file_time_type::clock::now(), ec);
+    }
+
+  private:
+    static std::string hashFile(const std::filesystem::path &file,
+                                const std::string &checksumType) {
+        detail::FileDescriptor fd(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0)
+            return {};
+        Checksum checksum(checksumType, detail::threadCount(0));
+        std::vector<uint8_t> buff(MAX_BUF_SIZE);
+        for (size_t pos = 0;;) {
+            const auto len = detail::readAt(fd.get(), pos, buff.data(), buff.size());
+            if (len == 0)
+                break;
+            checksum.update(buff.data(), len);
+            pos += len;
+        }
+        return checksum.hexdigest();
+    }
+
+    std::filesystem::path dir;
+    std::atomic<size_t> nextTemp{0};
+};
+
+/**
+    Source that serves ranges found in a RangeStore from local storage and
+    reads only the other ones from `upstream`. With `populate`, ranges read
+    from upstream are added to the store once complete and verified.
+*/
+class CachedSource : public Source {
+  public:
+    struct Statistics {
+        size_t cachedBytes = 0;
+        size_t upstreamBytes = 0;
+        size_t cachedRanges = 0;
+        size_t addedRanges = 0;
+    };
+
+    CachedSource(Source &upstream, const BmapFile &bmapFile, RangeStore &store,
+                 bool populate = true)
+        : upstream(upstream), bmapFile(bmapFile), store(store),
+          populate(populate && Checksum::supported(bmapFile.checksumType)) {
+        for (size_t idx = 0; idx < bmapFile.blockMap.size(); idx++) {
+            // other ranges are read from upstream and never cached
+            const auto &range = bmapFile.blockMap[idx];
+            if (RangeStore::valid(bmapFile.checksumType, range.checksum))
+                ranges.push_back(idx);
+        }
+        std::sort(ranges.begin(), ranges.end(), [&](size_t a, size_t b) {
+            return bmapFile.blockMap[a].offset < bmapFile.blockMap[b].offset;
+        });
+    }
+
+    ~CachedSource() override {
+        for (const auto &[idx, pending] : pendingRanges)
+            std::filesystem::remove(pending.tmpPath);
+    }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        const auto idx = findRange(offset);
+        if (!idx)
+            return upstream.read(offset, buf, len);
+
+        const auto &range = bmapFile.blockMap[*idx];
+        const auto start = range.offset * bmapFile.blockSize;
+        const auto end = std::min(bmapFile.imageSize,
+                                  (range.offset + range.blockCount) *
+                                      bmapFile.blockSize);
+        len = std::min(len, end - offset);
+
+        const auto entry = store.path(bmapFile.checksumType, range.checksum);
+        detail::FileDescriptor cached(::open(entry.c_str(), O_RDONLY | O_CLOEXEC));
+        if (cached.get() >= 0) {
+            const auto count = detail::readAt(cached.get(), offset - start, buf, len);
+            std::lock_guard lock(mutex);
+            stats.cachedBytes += count;
+            if (offset == start) {
+                stats.cachedRanges++;
+                store.touch(entry);
+            }
+            return count;
+        }
+
+        const auto count = upstream.read(offset, buf, len);
+        {
+            std::lock_guard lock(mutex);
+            stats.upstreamBytes += count;
+        }
+        if (populate)
+            addToStore(*idx, offset - start, buf, count, end - start);
+        return count;
+    }
+
+    bool concurrentReads() const override { return upstream.concurrentReads(); }
+
+    Statistics statistics() const {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+  private:
+    struct Pending {
+        std::filesystem::path tmpPath;
+        std::shared_ptr<detail::FileDescriptor> file;
+        size_t bytes = 0;
+    };
+
+    // index of the checksummed range containing `offset`
+    std::optional<size_t> findRange(size_t offset) const {
+        const auto it = std::partition_point(
+            ranges.begin(), ranges.end(), [&](size_t idx) {
+                const auto &range = bmapFile.blockMap[idx];
+                return (range.offset + range.blockCount) * bmapFile.blockSize <=
+                       offset;
+            });
+        if (it == ranges.end() ||
+            bmapFile.blockMap[*it].offset * bmapFile.blockSize > offset)
+            return std::nullopt;
+        return *it;
+    }
+
+    void addToStore(size_t idx, size_t pos, const uint8_t *data, size_t len,
+                    size_t rangeBytes) {
+        std::shared_ptr<detail::FileDescriptor> file;
+        {
+            std::lock_guard lock(mutex);
+            auto &pending = pendingRanges[idx];
+            if (!pending.file) {
+                pending.tmpPath = store.tempPath();
+                pending.file = std::make_shared<detail::FileDescriptor>(
+                    ::open(pending.tmpPath.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+            }
+            file = pending.file;
+        }
+        if (file->get() < 0)
+            return;
+        detail::writeAt(file->get(), pos, data, len);
+
+        Pending complete;
+        {
+            std::lock_guard lock(mutex);
+            auto &pending = pendingRanges[idx];
+            pending.bytes += len;
+            if (pending.bytes < rangeBytes)
+                return;
+            complete = std::move(pending);
+            pendingRanges.erase(idx);
+        }
+        complete.file.reset();
+        const auto &range = bmapFile.blockMap[idx];
+        // chunks of a range read twice or corrupt data fail the hash check
+        if (store.commit(complete.tmpPath, bmapFile.checksumType,
+                         range.checksum)) {
+            std::lock_guard lock(mutex);
+            stats.addedRanges++;
+        }
+    }
+
+    Source &upstream;
+    const BmapFile &bmapFile;
+    RangeStore &store;
+    const bool populate;
+    // indices of the ranges with a valid cache key, sorted by offset
+    std::vector<size_t> ranges;
+
+    mutable std::mutex mutex;
+    std::map<size_t, Pending> pendingRanges;
+    Statistics stats;
+};
+
+} // namespace bmap
+
+#endif
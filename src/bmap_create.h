@@ -0,0 +1,557 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_CREATE_H
+#define BMAP_CREATE_H
+
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+enum class MappingMode {
+    // map everything the image file has allocated (lseek SEEK_DATA/SEEK_HOLE)
+    SeekData,
+    // map only blocks that ext4/FAT filesystems inside the image actually
+    // use. Areas not covered by a recognized filesystem fall back to SeekData
+    Filesystem,
+};
+
+struct CreateOptions {
+    size_t blockSize = 4096;
+    MappingMode mode = MappingMode::SeekData;
+    // worker threads for bitmap parsing and hashing. 0 = one per core
+    unsigned threads = 0;
+    // "sha256" or "blake3"
+    std::string checksumType = "sha256";
+};
+
+namespace detail {
+
+inline uint16_t le16(const uint8_t *p) { return p[0] | uint16_t(p[1]) << 8; }
+inline uint32_t le32(const uint8_t *p) {
+    return le16(p) | uint32_t(le16(p + 2)) << 16;
+}
+inline uint64_t le64(const uint8_t *p) {
+    return le32(p) | uint64_t(le32(p + 4)) << 32;
+}
+
+/**
+    One bit per bmap block. Bits are set with atomic ors so block groups can
+    be marked from multiple threads even if they share a word.
+*/
+class BlockBitmap {
+  public:
+    BlockBitmap(size_t blockSize, size_t blocks)
+        : blockSize(blockSize), blocks(blocks), words((blocks + 63) / 64) {}
+
+    void markBytes(size_t offset, size_t length) {
+        if (length == 0)
+            return;
+        const auto first = offset / blockSize;
+        const auto last =
+            std::min(blocks, (offset + length + blockSize - 1) / blockSize);
+        for (auto block = first; block < last;) {
+            const auto bit = block % 64;
+            const auto count = std::min<size_t>(64 - bit, last - block);
+            const auto mask =
+                count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1) << bit;
+            words[block / 64].fetch_or(mask, std::memory_order_relaxed);
+            block += count;
+        }
+    }
+
+    bool test(size_t block) const {
+        return words[block / 64].load(std::memory_order_relaxed) &
+               (uint64_t(1) << (block % 64));
+    }
+
+    size_t size() const { return blocks; }
+
+  private:
+    size_t blockSize;
+    size_t blocks;
+    std::vector<std::atomic<uint64_t>> words;
+};
+
+// byte extent inside the image
+struct Extent {
+    size_t offset;
+    size_t length;
+};
+
+inline void mapSeekData(int fd, const Extent &extent, BlockBitmap &bitmap) {
+    const auto end = extent.offset + extent.length;
+    for (off_t pos = extent.offset; size_t(pos) < end;) {
+        const auto data = ::lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) // no more data after pos
+                return;
+            // filesystem without SEEK_DATA support, map everything
+            bitmap.markBytes(pos, end - pos);
+            return;
+        }
+        if (size_t(data) >= end)
+            return;
+        auto hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            hole = end;
+        const auto dataEnd = std::min<size_t>(hole, end);
+        bitmap.markBytes(data, dataEnd - data);
+        pos = dataEnd;
+    }
+}
+
+constexpr const size_t SECTOR_SIZE = 512;
+
+// partitions from a GPT or MBR partition table. Empty if there is none.
+inline std::vector<Extent> partitions(int fd, size_t imageSize) {
+    std::array<uint8_t, SECTOR_SIZE> mbr;
+    if (readAt(fd, 0, mbr.data(), mbr.size()) != mbr.size() ||
+        le16(&mbr[510]) != 0xAA55) {
+        return {};
+    }
+
+    std::vector<Extent> result;
+    const auto addPartition = [&](uint64_t firstLba, uint64_t sectors) {
+        const auto offset = firstLba * SECTOR_SIZE;
+        if (sectors == 0 || offset >= imageSize)
+            return;
+        result.push_back(
+            {offset, std::min<size_t>(sectors * SECTOR_SIZE, imageSize - offset)});
+    };
+
+    bool protectiveMbr = false;
+    for (size_t i = 0; i < 4; i++) {
+        const auto entry = &mbr[446 + i * 16];
+        const auto type = entry[4];
+        if (type == 0xEE) {
+            protectiveMbr = true;
+        } else if (type != 0x00 && type != 0x05 && type != 0x0F &&
+                   type != 0x85) {
+            // extended partitions are left to the SEEK_DATA fallback
+            addPartition(le32(entry + 8), le32(entry + 12));
+        }
+    }
+    if (!protectiveMbr)
+        return result;
+
+    std::array<uint8_t, SECTOR_SIZE> header;
+    readExact(fd, SECTOR_SIZE, header.data(), header.size());
+    if (std::memcmp(header.data(), "EFI PART", 8) != 0) {
+        throw std::runtime_error("Protective MBR found but no GPT header");
+    }
+    const auto entriesLba = le64(&header[72]);
+    const auto entryCount = le32(&header[80]);
+    const auto entrySize = le32(&header[84]);
+    if (entrySize < 128 || entryCount > 1024) {
+        throw std::runtime_error("Invalid GPT header");
+    }
+
+    std::vector<uint8_t> entries(size_t(entryCount) * entrySize);
+    readExact(fd, entriesLba * SECTOR_SIZE, entries.data(), entries.size());
+    result.clear();
+    for (size_t i = 0; i < entryCount; i++) {
+        const auto entry = &entries[i * entrySize];
+        const std::array<uint8_t, 16> unused{};
+        if (std::memcmp(entry, unused.data(), unused.size()) == 0)
+            continue;
+        const auto first = le64(entry + 32);
+        const auto last = le64(entry + 40);
+        if (last >= first)
+            addPartition(first, last - first + 1);
+    }
+    return result;
+}
+
+namespace ext4 {
+constexpr const uint16_t MAGIC = 0xEF53;
+constexpr const uint32_t INCOMPAT_META_BG = 0x10;
+constexpr const uint32_t INCOMPAT_64BIT = 0x80;
+constexpr const uint32_t RO_COMPAT_SPARSE_SUPER = 0x1;
+constexpr const uint32_t RO_COMPAT_BIGALLOC = 0x200;
+constexpr const uint16_t BG_BLOCK_UNINIT = 0x2;
+
+inline bool isPowerOf(uint64_t n, uint64_t base) {
+    while (n > 1 && n % base == 0)
+        n /= base;
+    return n == 1;
+}
+
+/**
+    Marks the blocks allocated in the ext2/3/4 filesystem starting at
+    `part.offset`. Block group bitmaps are read in parallel.
+    Returns the bytes covered by the filesystem, 0 if there is no ext4
+    superblock.
+*/
+inline size_t map(int fd, const Extent &part, BlockBitmap &bitmap,
+                  unsigned threads) {
+    std::array<uint8_t, 1024> sb;
+    if (part.length < 2048 ||
+        readAt(fd, part.offset + 1024, sb.data(), sb.size()) != sb.size() ||
+        le16(&sb[56]) != MAGIC) {
+        return 0;
+    }
+
+    const uint64_t fsBlockSize = uint64_t(1024) << le32(&sb[24]);
+    const uint32_t firstDataBlock = le32(&sb[20]);
+    const uint32_t blocksPerGroup = le32(&sb[32]);
+    const uint32_t clustersPerGroup = le32(&sb[36]);
+    const uint32_t inodesPerGroup = le32(&sb[40]);
+    const uint32_t incompat = le32(&sb[96]);
+    const uint32_t roCompat = le32(&sb[100]);
+    const uint16_t inodeSize = le32(&sb[76]) == 0 ? 128 : le16(&sb[88]);
+    const uint16_t reservedGdtBlocks = le16(&sb[206]);
+    uint64_t blocksCount = le32(&sb[4]);
+    size_t descSize = 32;
+    if (incompat & INCOMPAT_64BIT) {
+        blocksCount |= uint64_t(le32(&sb[336])) << 32;
+        descSize = std::max<size_t>(32, le16(&sb[254]));
+    }
+    const uint64_t blocksPerBit =
+        (roCompat & RO_COMPAT_BIGALLOC) ? uint64_t(1) << (le32(&sb[28]) - le32(&sb[24]))
+                                        : 1;
+    const uint64_t bitsPerGroup =
+        (roCompat & RO_COMPAT_BIGALLOC) ? clustersPerGroup : blocksPerGroup;
+
+    if (fsBlockSize > 65536 || blocksPerGroup == 0 || bitsPerGroup == 0 ||
+        bitsPerGroup > fsBlockSize * 8 || blocksCount <= firstDataBlock) {
+        throw std::runtime_error("Corrupt ext4 superblock");
+    }
+
+    const auto fsBytes = std::min<size_t>(blocksCount * fsBlockSize, part.length);
+    const auto groups =
+        (blocksCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    const auto gdtBlocks = (groups * descSize + fsBlockSize - 1) / fsBlockSize;
+    const auto inodeTableBlocks =
+        (uint64_t(inodesPerGroup) * inodeSize + fsBlockSize - 1) / fsBlockSize;
+
+    const auto hasSuper = [&](uint64_t group) {
+        return !(roCompat & RO_COMPAT_SPARSE_SUPER) || group <= 1 ||
+               isPowerOf(group, 3) || isPowerOf(group, 5) || isPowerOf(group, 7);
+    };
+
+    // without META_BG the descriptors follow the superblock in one table.
+    // With it, only the first `s_first_meta_bg` descriptor blocks are there,
+    // the others start each meta group (descPerBlock groups), after its
+    // superblock backup
+    const auto descPerBlock = fsBlockSize / descSize;
+    const uint64_t firstMetaBg =
+        (incompat & INCOMPAT_META_BG) ? le32(&sb[260]) : gdtBlocks;
+    std::vector<uint8_t> gdt(gdtBlocks * fsBlockSize);
+    for (uint64_t idx = 0; idx < gdtBlocks;) {
+        if (idx < firstMetaBg) {
+            const auto count = std::min(firstMetaBg, gdtBlocks) - idx;
+            readExact(fd, part.offset + (firstDataBlock + 1 + idx) * fsBlockSize,
+                      &gdt[idx * fsBlockSize], count * fsBlockSize);
+            idx += count;
+            continue;
+        }
+        const auto group = idx * descPerBlock;
+        auto block = firstDataBlock + group * blocksPerGroup;
+        if (hasSuper(group))
+            block++;
+        // 1 KiB blocks with s_first_data_block 0: the boot block shifts the
+        // superblock into block 1 of group 0
+        if (fsBlockSize == 1024 && group == 0 && firstDataBlock == 0)
+            block++;
+        readExact(fd, part.offset + block * fsBlockSize, &gdt[idx * fsBlockSize],
+                  fsBlockSize);
+        idx++;
+    }
+
+    const auto markBlocks = [&](uint64_t block, uint64_t count) {
+        if (block >= blocksCount)
+            return;
+        count = std::min(count, blocksCount - block);
+        bitmap.markBytes(part.offset + block * fsBlockSize, count * fsBlockSize);
+    };
+
+    // boot block and primary superblock
+    markBlocks(0, firstDataBlock + 1);
+
+    parallelFor(groups, threads, [&](size_t group) {
+        const auto desc = &gdt[group * descSize];
+        const auto hi = [&](size_t offs) -> uint64_t {
+            return descSize >= 64 ? uint64_t(le32(desc + offs)) << 32 : 0;
+        };
+        const auto blockBitmap = le32(desc + 0x0) | hi(0x20);
+        const auto inodeBitmap = le32(desc + 0x4) | hi(0x24);
+        const auto inodeTable = le32(desc + 0x8) | hi(0x28);
+        const auto flags = le16(desc + 0x12);
+        const auto groupStart = firstDataBlock + group * blocksPerGroup;
+
+        // group metadata is always in use, with flex_bg it may live in
+        // another group but marking it twice does no harm
+        markBlocks(blockBitmap, 1);
+        markBlocks(inodeBitmap, 1);
+        markBlocks(inodeTable, inodeTableBlocks);
+
+        if (flags & BG_BLOCK_UNINIT) {
+            // bitmap was never written, only the superblock backup and
+            // group descriptors are allocated in this group
+            if (group >= firstMetaBg * descPerBlock) {
+                // META_BG keeps copies of the meta group's descriptor block
+                // in its first, second and last group
+                const auto inMetaGroup = group % descPerBlock;
+                const auto super = hasSuper(group) ? 1 : 0;
+                if (inMetaGroup <= 1 || inMetaGroup == descPerBlock - 1)
+                    markBlocks(groupStart, super + 1);
+                else
+                    markBlocks(groupStart, super);
+            } else if (hasSuper(group)) {
+                markBlocks(groupStart, 1 + gdtBlocks + reservedGdtBlocks);
+            }
+            return;
+        }
+
+        std::vector<uint8_t> bits(fsBlockSize);
+        readExact(fd, part.offset + blockBitmap * fsBlockSize, bits.data(),
+                  bits.size());
+        for (uint64_t bit = 0; bit < bitsPerGroup;) {
+            if (!(bits[bit / 8] & (1 << (bit % 8)))) {
+                bit++;
+                continue;
+            }
+            const auto runStart = bit;
+            while (bit < bitsPerGroup && (bits[bit / 8] & (1 << (bit % 8))))
+                bit++;
+            markBlocks(groupStart + runStart * blocksPerBit,
+                       (bit - runStart) * blocksPerBit);
+        }
+    });
+
+    return fsBytes;
+}
+} // namespace ext4
+
+namespace fat {
+/**
+    Marks the reserved area, FATs, root directory and all allocated clusters
+    of a FAT12/16/32 filesystem starting at `part.offset`. The FAT is split in
+    slices which are scanned in parallel.
+    Returns the bytes covered by the filesystem, 0 if there is no FAT boot
+    sector.
+*/
+inline size_t map(int fd, const Extent &part, BlockBitmap &bitmap,
+                  unsigned threads) {
+    std::array<uint8_t, SECTOR_SIZE> bs;
+    if (part.length < SECTOR_SIZE ||
+        readAt(fd, part.offset, bs.data(), bs.size()) != bs.size() ||
+        le16(&bs[510]) != 0xAA55 || (bs[0] != 0xEB && bs[0] != 0xE9)) {
+        return 0;
+    }
+
+    const size_t bytesPerSector = le16(&bs[11]);
+    const size_t sectorsPerCluster = bs[13];
+    const size_t reservedSectors = le16(&bs[14]);
+    const size_t fatCount = bs[16];
+    const size_t rootEntries = le16(&bs[17]);
+    const size_t totalSectors = le16(&bs[19]) ? le16(&bs[19]) : le32(&bs[32]);
+    const size_t fatSectors = le16(&bs[22]) ? le16(&bs[22]) : le32(&bs[36]);
+
+    const auto isPow2 = [](size_t v) { return v && !(v & (v - 1)); };
+    if (bytesPerSector < 512 || bytesPerSector > 4096 ||
+        !isPow2(bytesPerSector) || !isPow2(sectorsPerCluster) ||
+        reservedSectors == 0 || fatCount == 0 || fatSectors == 0) {
+        return 0;
+    }
+
+    const auto rootDirSectors =
+        (rootEntries * 32 + bytesPerSector - 1) / bytesPerSector;
+    const auto dataStart =
+        reservedSectors + fatCount * fatSectors + rootDirSectors;
+    if (totalSectors <= dataStart)
+        return 0;
+    const auto clusters = (totalSectors - dataStart) / sectorsPerCluster;
+    const auto fsBytes =
+        std::min<size_t>(totalSectors * bytesPerSector, part.length);
+    const auto clusterBytes = sectorsPerCluster * bytesPerSector;
+
+    bitmap.markBytes(part.offset, dataStart * bytesPerSector);
+
+    std::vector<uint8_t> table(fatSectors * bytesPerSector);
+    readExact(fd, part.offset + reservedSectors * bytesPerSector, table.data(),
+              table.size());
+
+    const auto entry = [&](size_t cluster) -> uint32_t {
+        if (clusters < 4085) {
+            const auto offs = cluster + cluster / 2;
+            if (offs + 1 >= table.size())
+                return 0;
+            const auto val = le16(&table[offs]);
+            return cluster & 1 ? val >> 4 : val & 0xFFF;
+        }
+        if (clusters < 65525) {
+            return cluster * 2 + 1 < table.size() ? le16(&table[cluster * 2])
+                                                  : 0;
+        }
+        return cluster * 4 + 3 < table.size()
+                   ? le32(&table[cluster * 4]) & 0x0FFFFFFF
+                   : 0;
+    };
+
+    constexpr const size_t CLUSTERS_PER_SLICE = 64 * 1024;
+    const auto slices = (clusters + CLUSTERS_PER_SLICE - 1) / CLUSTERS_PER_SLICE;
+    parallelFor(slices, threads, [&](size_t slice) {
+        const auto first = slice * CLUSTERS_PER_SLICE;
+        const auto last = std::min(clusters, first + CLUSTERS_PER_SLICE);
+        for (auto idx = first; idx < last;) {
+            if (entry(idx + 2) == 0) {
+                idx++;
+                continue;
+            }
+            const auto runStart = idx;
+            while (idx < last && entry(idx + 2) != 0)
+                idx++;
+            bitmap.markBytes(part.offset + dataStart * bytesPerSector +
+                                 runStart * clusterBytes,
+                             (idx - runStart) * clusterBytes);
+        }
+    });
+
+    return fsBytes;
+}
+} // namespace fat
+
+/**
+    Maps the filesystems of the image. Returns the extents that are owned by
+    a recognized filesystem.
+*/
+inline std::vector<Extent> mapFilesystems(int fd, size_t imageSize,
+                                          BlockBitmap &bitmap,
+                                          unsigned threads) {
+    const auto mapPartition = [&](const Extent &part) -> size_t {
+        if (const auto covered = ext4::map(fd, part, bitmap, threads))
+            return covered;
+        return fat::map(fd, part, bitmap, threads);
+    };
+
+    // filesystem without partition table, e.g. a plain ext4 or FAT image
+    const auto whole = Extent{0, imageSize};
+    if (const auto covered = mapPartition(whole))
+        return {{0, covered}};
+
+    std::vector<Extent> owned;
+    for (const auto &part : partitions(fd, imageSize)) {
+        if (const auto covered = mapPartition(part))
+            owned.push_back({part.offset, covered});
+    }
+    std::sort(owned.begin(), owned.end(),
+              [](const auto &a, const auto &b) { return a.offset < b.offset; });
+    return owned;
+}
+
+inline void validate(const CreateOptions &options) {
+    if (options.blockSize == 0 ||
+        (options.blockSize & (options.blockSize - 1)) != 0) {
+        throw std::runtime_error("Block size must be a power of two");
+    }
+    if (!Checksum::supported(options.checksumType)) {
+        throw std::runtime_error(std::format("Unsupported checksum type {}",
+                                             options.checksumType));
+    }
+}
+
+/**
+    The mapped ranges of the image, without checksums.
+*/
+inline std::vector<Range> mapRanges(int fd, size_t imageSize,
+                                    const CreateOptions &options) {
+    const auto blockSize = options.blockSize;
+    const auto blocksCount = (imageSize + blockSize - 1) / blockSize;
+
+    BlockBitmap bitmap(blockSize, blocksCount);
+
+    std::vector<Extent> owned;
+    if (options.mode == MappingMode::Filesystem) {
+        owned = mapFilesystems(fd, imageSize, bitmap,
+                               threadCount(options.threads));
+    }
+    // everything not owned by a filesystem is mapped by allocation
+    size_t pos = 0;
+    for (const auto &extent : owned) {
+        if (extent.offset > pos) {
+            mapSeekData(fd, {pos, extent.offset - pos}, bitmap);
+        }
+        pos = std::max(pos, extent.offset + extent.length);
+    }
+    if (pos < imageSize) {
+        mapSeekData(fd, {pos, imageSize - pos}, bitmap);
+    }
+
+    std::vector<Range> blockMap;
+    for (size_t block = 0; block < blocksCount;) {
+        if (!bitmap.test(block)) {
+            block++;
+            continue;
+        }
+        const auto start = block;
+        while (block < blocksCount && bitmap.test(block))
+            block++;
+        blockMap.push_back(Range{start, block - start, {}});
+    }
+    return blockMap;
+}
+
+} // namespace detail
+
+/**
+    Creates a bmap for the image at `imagePath`.
+    The per range checksums are calculated in parallel.
+*/
+inline BmapFile create(const std::string &imagePath,
+                       const CreateOptions &options = {}) {
+    detail::validate(options);
+
+    detail::FileDescriptor file(::open(imagePath.c_str(), O_RDONLY));
+    if (file.get() < 0) {
+        throw std::runtime_error(std::format("Unable to open image {}: {}",
+                                             imagePath, strerror(errno)));
+    }
+    struct stat st;
+    if (::fstat(file.get(), &st) != 0) {
+        throw std::runtime_error(
+            std::format("Unable to stat image {}", imagePath));
+    }
+
+    const auto imageSize = size_t(st.st_size);
+    const auto blockSize = options.blockSize;
+    const auto blocksCount = (imageSize + blockSize - 1) / blockSize;
+    const auto threads = detail::threadCount(options.threads);
+
+    auto blockMap = detail::mapRanges(file.get(), imageSize, options);
+    size_t mappedBlocksCount = 0;
+    for (const auto &range : blockMap)
+        mappedBlocksCount += range.blockCount;
+
+    // with fewer ranges than threads, BLAKE3 splits each range instead
+    const auto rangeThreads = blockMap.size() < threads ? threads : 1;
+    detail::parallelFor(blockMap.size(), threads, [&](size_t idx) {
+        auto &range = blockMap[idx];
+        std::vector<uint8_t> buff(std::min(range.blockCount * blockSize,
+                                           MAX_BUF_SIZE));
+        Checksum sha(options.checksumType, rangeThreads);
+        auto offset = range.offset * blockSize;
+        const auto end = std::min(imageSize, offset + range.blockCount * blockSize);
+        while (offset < end) {
+            const auto len = std::min(buff.size(), end - offset);
+            detail::readExact(file.get(), offset, buff.data(), len);
+            sha.update(buff.data(), len);
+            offset += len;
+        }
+        range.checksum = sha.hexdigest();
+    });
+
+    return BmapFile{imageSize,         blockSize, blocksCount,
+                    mappedBlocksCount, options.checksumType, "",
+                    std::move(blockMap)};
+}
+
+} // namespace bmap
+
+#endif
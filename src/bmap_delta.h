@@ -0,0 +1,202 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_DELTA_H
+#define BMAP_DELTA_H
+
+#include <optional>
+
+#include <fcntl.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct DeltaOptions {
+    // Optional. If both images are given, ranges which don't match one to one
+    // between the bmaps are split and compared chunk by chunk, so only the
+    // chunks that really changed end up in the delta. Without the images a
+    // new range is either unchanged (same extent and checksum) or sent whole.
+    std::string oldImagePath;
+    std::string newImagePath;
+    // compare granularity in blocks
+    size_t chunkBlocks = 256;
+    // 0 = one per core
+    unsigned threads = 0;
+};
+
+namespace detail {
+
+inline std::vector<Range> sortedRanges(const std::vector<Range> &ranges) {
+    auto sorted = ranges;
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto &a, const auto &b) { return a.offset < b.offset; });
+    return sorted;
+}
+
+inline int openImage(const std::string &path) {
+    const auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(
+            std::format("Unable to open image {}: {}", path, strerror(errno)));
+    }
+    return fd;
+}
+
+inline std::string hashBlocks(int fd, size_t blockSize, size_t offset,
+                              size_t blockCount,
+                              const std::string &checksumType) {
+    // ranges of unsupported checksum types are left unverified
+    if (!Checksum::supported(checksumType))
+        return {};
+    std::vector<uint8_t> buff(std::min(blockCount * blockSize, MAX_BUF_SIZE));
+    Checksum sha(checksumType);
+    for (auto pos = offset * blockSize, end = pos + blockCount * blockSize;
+         pos < end;) {
+        const auto len = readAt(fd, pos, buff.data(), std::min(buff.size(), end - pos));
+        if (len == 0)
+            break;
+        sha.update(buff.data(), len);
+        pos += len;
+    }
+    return sha.hexdigest();
+}
+
+} // namespace detail
+
+/**
+    Computes the delta from `oldBmap` to `newBmap`: a bmap listing only the
+    blocks that have to be written to turn a device holding the old image
+    into one holding the new image. Those are the new ranges whose content
+    changed and the blocks that were not mapped in the old image.
+    The result is a regular bmap and can be passed to `copy` together with the
+    new image.
+*/
+inline BmapFile delta(const BmapFile &oldBmap, const BmapFile &newBmap,
+                      const DeltaOptions &options = {}) {
+    if (oldBmap.blockSize != newBmap.blockSize) {
+        throw std::runtime_error(std::format(
+            "Block sizes differ: {} vs {}", std::to_string(oldBmap.blockSize),
+            std::to_string(newBmap.blockSize)));
+    }
+    if (options.oldImagePath.empty() != options.newImagePath.empty()) {
+        throw std::runtime_error(
+            "Either both or none of the images have to be given");
+    }
+    if (options.chunkBlocks == 0) {
+        throw std::runtime_error("Chunk size must not be 0");
+    }
+
+    const auto blockSize = newBmap.blockSize;
+    const auto oldRanges = detail::sortedRanges(oldBmap.blockMap);
+    const auto newRanges = detail::sortedRanges(newBmap.blockMap);
+    const bool sameChecksums = oldBmap.checksumType == newBmap.checksumType;
+    const bool compareContent = !options.newImagePath.empty();
+
+    std::optional<detail::FileDescriptor> oldImage, newImage;
+    if (compareContent) {
+        oldImage.emplace(detail::openImage(options.oldImagePath));
+        newImage.emplace(detail::openImage(options.newImagePath));
+    }
+
+    std::vector<std::vector<Range>> changed(newRanges.size());
+    detail::parallelFor(
+        newRanges.size(), detail::threadCount(options.threads),
+        [&](size_t idx) {
+            const auto &range = newRanges[idx];
+            const auto rangeEnd = range.offset + range.blockCount;
+
+            // first old range ending after the start of this one
+            auto it = std::partition_point(
+                oldRanges.begin(), oldRanges.end(), [&](const auto &old) {
+                    return old.offset + old.blockCount <= range.offset;
+                });
+            // ranges without a checksum (edited bmaps, qcow2 plans) can only
+            // be compared by content
+            if (it != oldRanges.end() && sameChecksums &&
+                !range.checksum.empty() && it->offset == range.offset &&
+                it->blockCount == range.blockCount &&
+                it->checksum == range.checksum) {
+                return;
+            }
+            if (!compareContent) {
+                changed[idx].push_back(range);
+                return;
+            }
+
+            std::vector<uint8_t> oldBuff, newBuff;
+            std::vector<std::pair<size_t, size_t>> dirty;
+            const auto markDirty = [&](size_t start, size_t end) {
+                if (!dirty.empty() && dirty.back().second == start) {
+                    dirty.back().second = end;
+                } else {
+                    dirty.emplace_back(start, end);
+                }
+            };
+
+            for (auto pos = range.offset; pos < rangeEnd;) {
+                while (it != oldRanges.end() &&
+                       it->offset + it->blockCount <= pos) {
+                    ++it;
+                }
+                const bool covered = it != oldRanges.end() && it->offset <= pos;
+                // pieces end at old range boundaries and chunk boundaries
+                auto end = std::min(rangeEnd,
+                                    (pos / options.chunkBlocks + 1) *
+                                        options.chunkBlocks);
+                if (it != oldRanges.end()) {
+                    end = std::min(end, covered ? it->offset + it->blockCount
+                                                : it->offset);
+                }
+
+                if (!covered) {
+                    markDirty(pos, end);
+                    pos = end;
+                    continue;
+                }
+
+                const auto bytes = (end - pos) * blockSize;
+                oldBuff.resize(bytes);
+                newBuff.resize(bytes);
+                const auto oldLen = detail::readAt(
+                    oldImage->get(), pos * blockSize, oldBuff.data(), bytes);
+                const auto newLen = detail::readAt(
+                    newImage->get(), pos * blockSize, newBuff.data(), bytes);
+                if (oldLen != newLen ||
+                    std::memcmp(oldBuff.data(), newBuff.data(), newLen) != 0) {
+                    markDirty(pos, end);
+                }
+                pos = end;
+            }
+
+            for (const auto &[start, end] : dirty) {
+                if (start == range.offset && end == rangeEnd) {
+                    changed[idx].push_back(range);
+                } else {
+                    changed[idx].push_back(
+                        Range{start, end - start,
+                              detail::hashBlocks(newImage->get(), blockSize,
+                                                 start, end - start,
+                                                 newBmap.checksumType)});
+                }
+            }
+        });
+
+    std::vector<Range> blockMap;
+    size_t mappedBlocksCount = 0;
+    for (auto &ranges : changed) {
+        for (auto &range : ranges) {
+            mappedBlocksCount += range.blockCount;
+            blockMap.push_back(std::move(range));
+        }
+    }
+
+    return BmapFile{newBmap.imageSize,       newBmap.blockSize,
+                    newBmap.blocksCount,     mappedBlocksCount,
+                    newBmap.checksumType,    "",
+                    std::move(blockMap)};
+}
+
+} // namespace bmap
+
+#endif
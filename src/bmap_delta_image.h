@@ -0,0 +1,516 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_DELTA_IMAGE_H
+#define BMAP_DELTA_IMAGE_H
+
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bmap.h"
+
+/**
+    Delta image: the blocks listed in a (delta) bmap, compressed per record.
+
+    header   "BMAPDIMG" | u32 version | u32 blockSize | u64 imageSize
+             | u64 recordCount
+    records  "RNGE" | u32 reserved | u64 offset (blocks) | u64 blockCount
+             | u64 rawSize | u64 compressedSize | zlib stream
+    index    u64 file offset of each record
+    footer   u64 index offset | "BMAPDIDX"
+
+    All integers are little endian. Every record is a separate zlib stream, so
+    records can be decompressed independently and in parallel. A record never
+    spans more than one range but long ranges are split into several records.
+    The records are written in bmap order, which lets the reader consume the
+    file as a stream (e.g. from a pipe) when the bmap is copied front to back.
+*/
+
+namespace bmap {
+
+struct DeltaImageOptions {
+    int compressionLevel = Z_DEFAULT_COMPRESSION;
+    // upper bound for the uncompressed size of a record
+    size_t maxRecordSize = 16 * 1024 * 1024;
+    // 0 = one per core
+    unsigned threads = 0;
+};
+
+namespace delta_image {
+constexpr const char MAGIC[] = "BMAPDIMG";
+constexpr const char FOOTER_MAGIC[] = "BMAPDIDX";
+constexpr const char RECORD_MAGIC[] = "RNGE";
+constexpr const uint32_t VERSION = 1;
+constexpr const size_t HEADER_SIZE = 32;
+constexpr const size_t RECORD_HEADER_SIZE = 40;
+constexpr const size_t FOOTER_SIZE = 16;
+
+inline void put32(uint8_t *p, uint32_t v) {
+    for (size_t i = 0; i < 4; i++)
+        p[i] = uint8_t(v >> (8 * i));
+}
+inline void put64(uint8_t *p, uint64_t v) {
+    for (size_t i = 0; i < 8; i++)
+        p[i] = uint8_t(v >> (8 * i));
+}
+inline uint32_t get32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4; i++)
+        v |= uint32_t(p[i]) << (8 * i);
+    return v;
+}
+inline uint64_t get64(const uint8_t *p) {
+    return get32(p) | uint64_t(get32(p + 4)) << 32;
+}
+
+struct Record {
+    size_t offset; // blocks
+    size_t blockCount;
+    size_t rawSize;
+    size_t compressedSize;
+    size_t fileOffset; // of the record header
+};
+
+inline std::vector<uint8_t> compress(int fd, size_t offset, size_t len,
+                                     int level) {
+    z_stream zs{};
+    if (deflateInit(&zs, level) != Z_OK) {
+        throw std::runtime_error("deflateInit failed");
+    }
+
+    std::vector<uint8_t> in(std::min(len, MAX_BUF_SIZE));
+    std::vector<uint8_t> out(deflateBound(&zs, len));
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    int ret = Z_OK;
+    for (size_t pos = 0; ret != Z_STREAM_END;) {
+        const auto chunk = std::min(in.size(), len - pos);
+        detail::readExact(fd, offset + pos, in.data(), chunk);
+        pos += chunk;
+        zs.next_in = in.data();
+        zs.avail_in = chunk;
+        ret = deflate(&zs, pos == len ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR || (ret != Z_STREAM_END && pos == len)) {
+            deflateEnd(&zs);
+            throw std::runtime_error("Compressing delta record failed");
+        }
+    }
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+} // namespace delta_image
+
+/**
+    Writes the blocks listed in `deltaBmap` from `newImagePath` to a delta
+    image at `outPath`. Records are compressed in parallel and written
+    sorted by offset; unsorted or overlapping bmaps are normalized first.
+*/
+inline void write_delta_image(const BmapFile &deltaBmap,
+                              const std::string &newImagePath,
+                              const std::string &outPath,
+                              const DeltaImageOptions &options = {}) {
+    using namespace delta_image;
+    // records are written in bmap order, readers look them up by offset
+    if (!deltaBmap.normalized()) {
+        auto normalized = deltaBmap;
+        normalized.normalize();
+        write_delta_image(normalized, newImagePath, outPath, options);
+        return;
+    }
+
+    const auto blockSize = deltaBmap.blockSize;
+    const auto recordBlocks = std::max<size_t>(1, options.maxRecordSize / blockSize);
+
+    std::vector<Record> records;
+    for (const auto &range : deltaBmap.blockMap) {
+        for (size_t done = 0; done < range.blockCount; done += recordBlocks) {
+            const auto blocks = std::min(recordBlocks, range.blockCount - done);
+            const auto offset = range.offset + done;
+            const auto byteOffset = offset * blockSize;
+            if (byteOffset >= deltaBmap.imageSize)
+                break;
+            const auto rawSize = std::min(blocks * blockSize,
+                                          deltaBmap.imageSize - byteOffset);
+            records.push_back(Record{offset, blocks, rawSize, 0, 0});
+        }
+    }
+
+    detail::FileDescriptor image(::open(newImagePath.c_str(), O_RDONLY));
+    if (image.get() < 0) {
+        throw std::runtime_error(std::format("Unable to open image {}: {}",
+                                             newImagePath, strerror(errno)));
+    }
+    detail::FileDescriptor out(
+        ::open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (out.get() < 0) {
+        throw std::runtime_error(std::format(
+            "Unable to create delta image {}: {}", outPath, strerror(errno)));
+    }
+
+    std::array<uint8_t, HEADER_SIZE> header{};
+    std::memcpy(header.data(), MAGIC, 8);
+    put32(&header[8], VERSION);
+    put32(&header[12], uint32_t(blockSize));
+    put64(&header[16], deltaBmap.imageSize);
+    put64(&header[24], records.size());
+    detail::writeAt(out.get(), 0, header.data(), header.size());
+
+    // compress a window of records in parallel, write them in order
+    const auto threads = detail::threadCount(options.threads);
+    const size_t window = threads * 2;
+    size_t filePos = HEADER_SIZE;
+    std::vector<std::vector<uint8_t>> compressed(window);
+    for (size_t first = 0; first < records.size(); first += window) {
+        const auto count = std::min(window, records.size() - first);
+        detail::parallelFor(count, threads, [&](size_t idx) {
+            const auto &record = records[first + idx];
+            compressed[idx] =
+                compress(image.get(), record.offset * blockSize, record.rawSize,
+                         options.compressionLevel);
+        });
+
+        for (size_t idx = 0; idx < count; idx++) {
+            auto &record = records[first + idx];
+            record.compressedSize = compressed[idx].size();
+            record.fileOffset = filePos;
+
+            std::array<uint8_t, RECORD_HEADER_SIZE> recordHeader{};
+            std::memcpy(recordHeader.data(), RECORD_MAGIC, 4);
+            put64(&recordHeader[8], record.offset);
+            put64(&recordHeader[16], record.blockCount);
+            put64(&recordHeader[24], record.rawSize);
+            put64(&recordHeader[32], record.compressedSize);
+            detail::writeAt(out.get(), filePos, recordHeader.data(),
+                            recordHeader.size());
+            detail::writeAt(out.get(), filePos + RECORD_HEADER_SIZE,
+                            compressed[idx].data(), compressed[idx].size());
+            filePos += RECORD_HEADER_SIZE + compressed[idx].size();
+            compressed[idx] = {};
+        }
+    }
+
+    std::vector<uint8_t> index(records.size() * 8 + FOOTER_SIZE);
+    for (size_t idx = 0; idx < records.size(); idx++)
+        put64(&index[idx * 8], records[idx].fileOffset);
+    put64(&index[records.size() * 8], filePos);
+    std::memcpy(&index[records.size() * 8 + 8], FOOTER_MAGIC, 8);
+    detail::writeAt(out.get(), filePos, index.data(), index.size());
+}
+
+/**
+    Reads a delta image as copy engine source. Files are accessed through the
+    index with pread, so ranges can be read in any order and concurrently.
+    Pipes ("-" for stdin) are read as a stream, which requires the bmap to
+    be copied front to back. Reading blocks that are not part of the delta
+    image is an error.
+*/
+class DeltaImageSource : public Source {
+  public:
+    explicit DeltaImageSource(const std::string &path)
+        : file(path == "-" ? ::dup(STDIN_FILENO)
+                           : ::open(path.c_str(), O_RDONLY)) {
+        using namespace delta_image;
+
+        if (file.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open delta image {}: {}", path, strerror(errno)));
+        }
+        struct stat st;
+        seekable = ::fstat(file.get(), &st) == 0 && S_ISREG(st.st_mode);
+
+        std::array<uint8_t, HEADER_SIZE> header;
+        readFile(header.data(), header.size());
+        if (std::memcmp(header.data(), MAGIC, 8) != 0 ||
+            get32(&header[8]) != VERSION) {
+            throw std::runtime_error(
+                std::format("{} is not a delta image", path));
+        }
+        blkSize = get32(&header[12]);
+        imgSize = get64(&header[16]);
+        recordCount = get64(&header[24]);
+        if (blkSize == 0) {
+            throw std::runtime_error(
+                std::format("{} has block size 0", path));
+        }
+
+        if (seekable)
+            readIndex();
+    }
+
+    // also checks that the image was written for the geometry of `bmapFile`
+    DeltaImageSource(const std::string &path, const BmapFile &bmapFile)
+        : DeltaImageSource(path) {
+        if (blkSize != bmapFile.blockSize || imgSize != bmapFile.imageSize) {
+            throw std::runtime_error(std::format(
+                "Delta image {} has block size {} and image size {}, the bmap "
+                "{} and {}",
+                path, std::to_string(blkSize), std::to_string(imgSize),
+                std::to_string(bmapFile.blockSize),
+                std::to_string(bmapFile.imageSize)));
+        }
+    }
+
+    size_t blockSize() const { return blkSize; }
+    size_t imageSize() const { return imgSize; }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        detail::TraceSpan span(TraceRecorder::Event::Decompress, offset, len);
+        auto cursor = seekable ? takeCursor(offset) : std::move(stream);
+        size_t done = 0;
+        while (done < len) {
+            const auto pos = offset + done;
+            if (!cursor || pos < cursor->position(blkSize) ||
+                pos >= cursor->end(blkSize)) {
+                if (pos >= imgSize)
+                    break;
+                seekRecord(pos, cursor);
+            }
+            // skip forward inside the record
+            while (cursor->position(blkSize) < pos) {
+                std::array<uint8_t, 64 * 1024> scratch;
+                inflateInto(*cursor, scratch.data(),
+                            std::min(scratch.size(),
+                                     pos - cursor->position(blkSize)));
+            }
+            const auto count = std::min(len - done, cursor->end(blkSize) - pos);
+            inflateInto(*cursor, buf + done, count);
+            done += count;
+        }
+        if (seekable) {
+            returnCursor(std::move(cursor));
+        } else {
+            stream = std::move(cursor);
+        }
+        return done;
+    }
+
+    // the index and file are read-only, every read decompresses on its own
+    // cursor
+    bool concurrentReads() const override { return seekable; }
+
+  private:
+    // decompression state of one record
+    struct Cursor {
+        explicit Cursor(const delta_image::Record &record) : record(record) {
+            if (inflateInit(&zs) != Z_OK) {
+                throw std::runtime_error("inflateInit failed");
+            }
+        }
+        ~Cursor() { inflateEnd(&zs); }
+        Cursor(const Cursor &) = delete;
+        Cursor &operator=(const Cursor &) = delete;
+
+        size_t position(size_t blkSize) const {
+            return record.offset * blkSize + rawPos;
+        }
+        size_t end(size_t blkSize) const {
+            return record.offset * blkSize + record.rawSize;
+        }
+
+        delta_image::Record record;
+        z_stream zs{};
+        size_t rawPos = 0;
+        size_t compressedRead = 0;
+        std::vector<uint8_t> input = std::vector<uint8_t>(256 * 1024);
+    };
+
+    // idle cursors kept for reads continuing where an earlier one stopped
+    static constexpr const size_t MAX_IDLE_CURSORS = 16;
+
+    // an idle cursor positioned at `offset`, if any
+    std::unique_ptr<Cursor> takeCursor(size_t offset) {
+        std::lock_guard lock(mutex);
+        const auto it = std::ranges::find_if(idle, [&](const auto &cursor) {
+            return cursor->position(blkSize) == offset;
+        });
+        if (it == idle.end())
+            return nullptr;
+        auto cursor = std::move(*it);
+        idle.erase(it);
+        return cursor;
+    }
+
+    void returnCursor(std::unique_ptr<Cursor> cursor) {
+        if (!cursor || cursor->position(blkSize) == cursor->end(blkSize))
+            return;
+        std::lock_guard lock(mutex);
+        if (idle.size() == MAX_IDLE_CURSORS)
+            idle.erase(idle.begin());
+        idle.push_back(std::move(cursor));
+    }
+
+    void readFile(uint8_t *buf, size_t len) {
+        for (size_t done = 0; done < len;) {
+            const auto res = ::read(file.get(), buf + done, len - done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0) {
+                throw std::runtime_error("Unexpected end of delta image");
+            }
+            done += res;
+        }
+    }
+
+    delta_image::Record parseRecordHeader(const uint8_t *p, size_t fileOffset) {
+        using namespace delta_image;
+        if (std::memcmp(p, RECORD_MAGIC, 4) != 0) {
+            throw std::runtime_error("Corrupt delta image record");
+        }
+        return Record{get64(p + 8), get64(p + 16), get64(p + 24),
+                      get64(p + 32), fileOffset};
+    }
+
+    void readIndex() {
+        using namespace delta_image;
+        struct stat st;
+        if (::fstat(file.get(), &st) != 0 ||
+            static_cast<size_t>(st.st_size) < HEADER_SIZE + FOOTER_SIZE) {
+            throw std::runtime_error("Delta image index missing");
+        }
+        const auto footerOffset = st.st_size - FOOTER_SIZE;
+        std::array<uint8_t, FOOTER_SIZE> footer;
+        detail::readExact(file.get(), footerOffset, footer.data(),
+                          footer.size());
+        if (std::memcmp(&footer[8], FOOTER_MAGIC, 8) != 0) {
+            throw std::runtime_error("Delta image index missing");
+        }
+        // the header's record count must fit the index, don't trust it for
+        // the allocation
+        const auto indexOffset = get64(footer.data());
+        if (indexOffset < HEADER_SIZE || indexOffset > footerOffset ||
+            recordCount > (footerOffset - indexOffset) / 8) {
+            throw std::runtime_error(std::format(
+                "Delta image index at offset {} can't hold {} records",
+                std::to_string(indexOffset), std::to_string(recordCount)));
+        }
+        std::vector<uint8_t> index(recordCount * 8);
+        detail::readExact(file.get(), indexOffset, index.data(), index.size());
+        records.reserve(recordCount);
+        for (size_t idx = 0; idx < recordCount; idx++) {
+            const auto fileOffset = get64(&index[idx * 8]);
+            std::array<uint8_t, RECORD_HEADER_SIZE> recordHeader;
+            detail::readExact(file.get(), fileOffset, recordHeader.data(),
+                              recordHeader.size());
+            records.push_back(
+                parseRecordHeader(recordHeader.data(), fileOffset));
+        }
+        // seekRecord() searches by offset
+        if (!std::ranges::is_sorted(records, {}, &Record::offset)) {
+            throw std::runtime_error("Delta image records are not sorted");
+        }
+    }
+
+    void seekRecord(size_t pos, std::unique_ptr<Cursor> &cursor) {
+        using namespace delta_image;
+        const auto contains = [&](const Record &record) {
+            return pos >= record.offset * blkSize &&
+                   pos < record.offset * blkSize + record.rawSize;
+        };
+
+        if (seekable) {
+            auto it = std::partition_point(
+                records.begin(), records.end(), [&](const auto &record) {
+                    return record.offset * blkSize + record.rawSize <= pos;
+                });
+            if (it == records.end() || !contains(*it)) {
+                throw std::runtime_error(std::format(
+                    "Offset {} is not part of the delta image",
+                    std::to_string(pos)));
+            }
+            cursor = std::make_unique<Cursor>(*it);
+            return;
+        }
+
+        if (cursor && pos < cursor->position(blkSize)) {
+            throw std::runtime_error(
+                "Streamed delta images can only be read front to back");
+        }
+        for (;;) {
+            if (cursor) {
+                // drop the rest of the current record
+                std::vector<uint8_t> scratch(64 * 1024);
+                for (auto left = cursor->record.compressedSize -
+                                 cursor->compressedRead;
+                     left > 0;) {
+                    const auto chunk = std::min(left, scratch.size());
+                    readFile(scratch.data(), chunk);
+                    left -= chunk;
+                }
+                cursor.reset();
+            }
+            if (recordsSeen == recordCount) {
+                throw std::runtime_error(std::format(
+                    "Offset {} is not part of the delta image",
+                    std::to_string(pos)));
+            }
+            std::array<uint8_t, RECORD_HEADER_SIZE> recordHeader;
+            readFile(recordHeader.data(), recordHeader.size());
+            recordsSeen++;
+            cursor = std::make_unique<Cursor>(
+                parseRecordHeader(recordHeader.data(), 0));
+            if (contains(cursor->record))
+                return;
+        }
+    }
+
+    void inflateInto(Cursor &cursor, uint8_t *out, size_t len) {
+        auto &zs = cursor.zs;
+        zs.next_out = out;
+        zs.avail_out = len;
+        while (zs.avail_out > 0) {
+            if (zs.avail_in == 0) {
+                const auto chunk =
+                    std::min(cursor.input.size(),
+                             cursor.record.compressedSize - cursor.compressedRead);
+                if (chunk == 0) {
+                    throw std::runtime_error("Truncated delta image record");
+                }
+                if (seekable) {
+                    detail::readExact(file.get(),
+                                      cursor.record.fileOffset +
+                                          delta_image::RECORD_HEADER_SIZE +
+                                          cursor.compressedRead,
+                                      cursor.input.data(), chunk);
+                } else {
+                    readFile(cursor.input.data(), chunk);
+                }
+                cursor.compressedRead += chunk;
+                zs.next_in = cursor.input.data();
+                zs.avail_in = chunk;
+            }
+            const auto ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END && zs.avail_out > 0) {
+                throw std::runtime_error("Delta image record too short");
+            }
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                throw std::runtime_error("Corrupt delta image record");
+            }
+        }
+        cursor.rawPos += len;
+    }
+
+    detail::FileDescriptor file;
+    bool seekable = false;
+    size_t blkSize = 0;
+    size_t imgSize = 0;
+    size_t recordCount = 0;
+    // index of seekable files, sorted by offset
+    std::vector<delta_image::Record> records;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Cursor>> idle;
+
+    // position in a streamed image
+    std::unique_ptr<Cursor> stream;
+    size_t recordsSeen = 0;
+};
+
+} // namespace bmap
+
+#endif
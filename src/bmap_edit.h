@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_EDIT_H
+#define BMAP_EDIT_H
+
+#include "bmap.h"
+
+namespace bmap {
+
+/**
+    Options of the bmap rewrite tools. Ranges that change their extent lose
+    their checksum. With `imagePath` set, those checksums are recalculated
+    from the image, otherwise the ranges are written without one and copy
+    does not verify them.
+*/
+struct EditOptions {
+    std::string imagePath;
+    // worker threads for hashing. 0 = one per core
+    unsigned threads = 0;
+};
+
+namespace detail {
+
+inline bool canRehash(const BmapFile &bmapFile, const EditOptions &options) {
+    return !options.imagePath.empty() &&
+           Checksum::supported(bmapFile.checksumType);
+}
+
+/**
+    Calculates the checksums of all ranges without one from the image.
+*/
+inline void rehash(BmapFile &bmapFile, const EditOptions &options) {
+    FileDescriptor file(::open(options.imagePath.c_str(), O_RDONLY));
+    if (file.get() < 0) {
+        throw std::runtime_error(std::format("Unable to open image {}: {}",
+                                             options.imagePath,
+                                             std::string(strerror(errno))));
+    }
+    struct stat st;
+    if (::fstat(file.get(), &st) != 0 || size_t(st.st_size) != bmapFile.imageSize) {
+        throw std::runtime_error(std::format(
+            "Image {} does not match the bmap image size {}", options.imagePath,
+            std::to_string(bmapFile.imageSize)));
+    }
+
+    std::vector<Range *> pending;
+    for (auto &range : bmapFile.blockMap) {
+        if (range.checksum.empty())
+            pending.push_back(&range);
+    }
+    const auto threads = threadCount(options.threads);
+    const auto rangeThreads = pending.size() < threads ? threads : 1;
+    parallelFor(pending.size(), threads, [&](size_t idx) {
+        auto &range = *pending[idx];
+        std::vector<uint8_t> buff(
+            std::min(range.blockCount * bmapFile.blockSize, MAX_BUF_SIZE));
+        Checksum sha(bmapFile.checksumType, rangeThreads);
+        auto offset = range.offset * bmapFile.blockSize;
+        const auto end = std::min(bmapFile.imageSize,
+                                  offset + range.blockCount * bmapFile.blockSize);
+        while (offset < end) {
+            const auto len = std::min(buff.size(), end - offset);
+            readExact(file.get(), offset, buff.data(), len);
+            sha.update(buff.data(), len);
+            offset += len;
+        }
+        range.checksum = sha.hexdigest();
+    });
+}
+
+inline BmapFile finish(BmapFile bmapFile, const EditOptions &options) {
+    const auto rehash = canRehash(bmapFile, options);
+    bmapFile.normalize(rehash);
+    if (rehash)
+        detail::rehash(bmapFile, options);
+    return bmapFile;
+}
+
+} // namespace detail
+
+/**
+    Sorts the ranges, drops empty ones, merges overlapping and duplicate ones
+    and recalculates MappedBlocksCount. Adjacent ranges are merged when the
+    image is available to checksum the result.
+*/
+inline BmapFile normalize(const BmapFile &bmapFile,
+                          const EditOptions &options = {}) {
+    return detail::finish(bmapFile, options);
+}
+
+/**
+    Union of the ranges of several bmaps of the same image, e.g. bmaps
+    created per partition. All bmaps need the same block size, the image
+    size is the largest one.
+*/
+inline BmapFile merge(const std::vector<BmapFile> &bmapFiles,
+                      const EditOptions &options = {}) {
+    if (bmapFiles.empty()) {
+        throw std::runtime_error("Nothing to merge");
+    }
+    auto result = bmapFiles.front();
+    for (const auto &bmapFile : bmapFiles | std::views::drop(1)) {
+        if (bmapFile.blockSize != result.blockSize) {
+            throw std::runtime_error(std::format(
+                "Block sizes differ ({} and {}), reblock the bmaps first",
+                std::to_string(result.blockSize),
+                std::to_string(bmapFile.blockSize)));
+        }
+        if (bmapFile.checksumType != result.checksumType) {
+            throw std::runtime_error(std::format(
+                "Checksum types differ ({} and {})", result.checksumType,
+                bmapFile.checksumType));
+        }
+        result.imageSize = std::max(result.imageSize, bmapFile.imageSize);
+        result.blocksCount = std::max(result.blocksCount, bmapFile.blocksCount);
+        result.blockMap.insert(result.blockMap.end(), bmapFile.blockMap.begin(),
+                               bmapFile.blockMap.end());
+    }
+    return detail::finish(std::move(result), options);
+}
+
+/**
+    Only the mapped blocks in [firstBlock, lastBlock] of `bmapFile`. The image
+    geometry stays the same, ranges crossing the interval are clipped.
+*/
+inline BmapFile subset(const BmapFile &bmapFile, size_t firstBlock,
+                       size_t lastBlock, const EditOptions &options = {}) {
+    if (firstBlock > lastBlock) {
+        throw std::runtime_error(std::format("Invalid block interval {}-{}",
+                                             std::to_string(firstBlock),
+                                             std::to_string(lastBlock)));
+    }
+    auto result = bmapFile;
+    result.blockMap.clear();
+    for (const auto &range : bmapFile.blockMap) {
+        const auto start = std::max(range.offset, firstBlock);
+        const auto end = std::min(range.offset + range.blockCount, lastBlock + 1);
+        if (start >= end)
+            continue;
+        const auto clipped = start != range.offset ||
+                             end != range.offset + range.blockCount;
+        result.blockMap.push_back(
+            Range{start, end - start, clipped ? std::string() : range.checksum});
+    }
+    return detail::finish(std::move(result), options);
+}
+
+/**
+    Converts `bmapFile` to another block size. Ranges keep their checksums
+    when the block size shrinks. When it grows, ranges are widened to whole
+    blocks, which maps some unmapped data too, and widened ranges lose their
+    checksum.
+*/
+inline BmapFile reblock(const BmapFile &bmapFile, size_t blockSize,
+                        const EditOptions &options = {}) {
+    if (blockSize == 0 || (blockSize & (blockSize - 1)) != 0) {
+        throw std::runtime_error("Block size must be a power of two");
+    }
+    auto result = bmapFile;
+    result.blockSize = blockSize;
+    result.blocksCount = (bmapFile.imageSize + blockSize - 1) / blockSize;
+    result.blockMap.clear();
+    for (const auto &range : bmapFile.blockMap) {
+        const auto first = range.offset * bmapFile.blockSize;
+        const auto end =
+            std::min((range.offset + range.blockCount) * bmapFile.blockSize,
+                     bmapFile.imageSize);
+        const auto start = first / blockSize;
+        const auto stop = (end + blockSize - 1) / blockSize;
+        // the last block of the image may be partial
+        const auto exact = first % blockSize == 0 &&
+                           (end % blockSize == 0 || end == bmapFile.imageSize);
+        result.blockMap.push_back(
+            Range{start, stop - start, exact ? range.checksum : std::string()});
+    }
+    return detail::finish(std::move(result), options);
+}
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,378 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_HOTPLUG_H
+#define BMAP_HOTPLUG_H
+
+#include <map>
+#include <optional>
+
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+/**
+    Block devices a hotplug flash accepts. Empty strings and 0 sizes match
+    anything; vendor and model are compared after trimming, as sysfs pads
+    them with spaces.
+*/
+struct HotplugRule {
+    std::string vendor;
+    std::string model;
+    size_t minSize = 0;
+    size_t maxSize = 0;
+};
+
+struct HotplugOptions {
+    // a device is flashed if any rule matches
+    std::vector<HotplugRule> rules;
+    // chunks read from the image before a device shows up
+    size_t prefetchChunks = 4;
+    // stop after this many devices were flashed. 0 = run until stop()
+    size_t maxDevices = 0;
+    // listen to udev instead of kernel events, udev announces a device
+    // once its node exists and has its permissions
+    bool udevEvents = true;
+};
+
+namespace detail {
+namespace hotplug {
+
+// udev monitor messages start with this header, see libudev-monitor.c
+struct UdevHeader {
+    char prefix[8];
+    uint32_t magic;
+    uint32_t headerSize;
+    uint32_t propertiesOffset;
+    uint32_t propertiesLength;
+    uint32_t filterSubsystemHash;
+    uint32_t filterDevtypeHash;
+    uint32_t filterTagBloomHi;
+    uint32_t filterTagBloomLo;
+};
+constexpr uint32_t UDEV_MAGIC = 0xfeedcafe;
+
+/**
+    Properties of a kernel ("add@/devices/...\0KEY=value\0...") or udev
+    monitor message. Empty for anything else.
+*/
+inline std::map<std::string, std::string> parseUevent(const char *data,
+                                                      size_t len) {
+    std::map<std::string, std::string> props;
+    size_t pos = 0;
+    if (len >= sizeof(UdevHeader) && std::memcmp(data, "libudev", 8) == 0) {
+        UdevHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (ntohl(header.magic) != UDEV_MAGIC ||
+            header.propertiesOffset + header.propertiesLength > len)
+            return props;
+        pos = header.propertiesOffset;
+        len = header.propertiesOffset + header.propertiesLength;
+    } else if (std::memchr(data, '@', std::min<size_t>(len, 64)) == nullptr) {
+        return props;
+    }
+
+    while (pos < len) {
+        const auto end = static_cast<const char *>(
+            std::memchr(data + pos, '\0', len - pos));
+        const auto field =
+            std::string_view(data + pos, end ? end - (data + pos) : len - pos);
+        const auto eq = field.find('=');
+        // the kernel's "action@devpath" summary has no '='
+        if (eq != std::string_view::npos) {
+            props.emplace(std::string(field.substr(0, eq)),
+                          std::string(field.substr(eq + 1)));
+        }
+        pos += field.size() + 1;
+    }
+    return props;
+}
+
+inline std::string readSysfs(const std::filesystem::path &path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    const auto first = value.find_first_not_of(" \t");
+    const auto last = value.find_last_not_of(" \t\n");
+    return first == std::string::npos ? std::string()
+                                      : value.substr(first, last - first + 1);
+}
+
+inline bool matches(const HotplugRule &rule, const std::filesystem::path &sysfs) {
+    if (!rule.vendor.empty() && readSysfs(sysfs / "device/vendor") != rule.vendor)
+        return false;
+    if (!rule.model.empty() && readSysfs(sysfs / "device/model") != rule.model)
+        return false;
+    // sysfs counts 512 byte sectors regardless of the logical block size;
+    // devices whose size doesn't parse are skipped
+    unsigned long long sectors = 0;
+    if (std::sscanf(readSysfs(sysfs / "size").c_str(), "%llu", &sectors) != 1)
+        return false;
+    const auto size = sectors * 512;
+    return size > 0 && size >= rule.minSize &&
+           (rule.maxSize == 0 || size <= rule.maxSize);
+}
+
+/**
+    True if the disk or one of its partitions is in use: mounted or used as
+    swap (by any node, e.g. /dev/disk/by-uuid/..., compared by device
+    number), or held by another block device (LVM, dm-crypt, md). Such a
+    device is never flashed.
+*/
+inline bool mounted(const std::string &devName) {
+    const auto disk = std::filesystem::path("/sys/block") / devName;
+    std::vector<std::filesystem::path> nodes{disk};
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(disk, ec)) {
+        if (std::filesystem::exists(entry.path() / "partition"))
+            nodes.push_back(entry.path());
+    }
+
+    std::vector<dev_t> devices;
+    for (const auto &node : nodes) {
+        if (!std::filesystem::is_empty(node / "holders", ec) && !ec)
+            return true;
+        unsigned major = 0, minor = 0;
+        if (std::sscanf(readSysfs(node / "dev").c_str(), "%u:%u", &major,
+                        &minor) == 2)
+            devices.push_back(makedev(major, minor));
+    }
+
+    // the first field of both is the device
+    for (const auto *table : {"/proc/self/mounts", "/proc/swaps"}) {
+        std::ifstream file(table);
+        for (std::string line; std::getline(file, line);) {
+            const auto source = line.substr(0, line.find(' '));
+            struct stat st;
+            if (source.starts_with('/') && ::stat(source.c_str(), &st) == 0 &&
+                S_ISBLK(st.st_mode) &&
+                std::ranges::find(devices, st.st_rdev) != devices.end())
+                return true;
+        }
+    }
+    return false;
+}
+
+} // namespace hotplug
+} // namespace detail
+
+/**
+    Source that serves the first chunks of the copy plan from memory. The
+    chunks are read when it is created, so a copy started on it writes
+    right away instead of waiting for the image. The plan has to use the
+    same `ioSize` (and no adaptive sizing) for the chunks to line up, other
+    reads go to `upstream`.
+*/
+class PrefetchedSource : public Source {
+  public:
+    PrefetchedSource(Source &upstream, const BmapFile &bmapFile, size_t ioSize,
+                     size_t chunks)
+        : upstream(upstream) {
+        detail::ChunkPlanner planner(bmapFile);
+        for (detail::ChunkPlanner::Chunk chunk;
+             prefetched.size() < chunks && planner.next(ioSize, chunk);) {
+            auto &[requested, data] = prefetched[chunk.offset];
+            requested = chunk.bytes;
+            data.resize(chunk.bytes);
+            data.resize(upstream.read(chunk.offset, data.data(), chunk.bytes));
+        }
+    }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        const auto it = prefetched.find(offset);
+        if (it == prefetched.end() || len > it->second.first)
+            return upstream.read(offset, buf, len);
+        // the last chunk may have been short
+        const auto &data = it->second.second;
+        const auto count = std::min(len, data.size());
+        std::memcpy(buf, data.data(), count);
+        return count;
+    }
+
+    bool concurrentReads() const override { return upstream.concurrentReads(); }
+
+  private:
+    Source &upstream;
+    // offset -> requested length and data. Read-only after construction,
+    // shared by concurrent copies
+    std::map<size_t, std::pair<size_t, IoBuffer>> prefetched;
+};
+
+/**
+    Listens for block devices appearing on the uevent netlink socket.
+*/
+class HotplugMonitor {
+  public:
+    explicit HotplugMonitor(bool udevEvents = true)
+        : sock(::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                        NETLINK_KOBJECT_UEVENT)) {
+        if (sock.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open the uevent socket: {}",
+                std::string(strerror(errno))));
+        }
+        sockaddr_nl addr{};
+        addr.nl_family = AF_NETLINK;
+        // group 1: kernel events, group 2: udev events
+        addr.nl_groups = udevEvents ? 2 : 1;
+        if (::bind(sock.get(), reinterpret_cast<sockaddr *>(&addr),
+                   sizeof(addr)) != 0) {
+            throw std::runtime_error(std::format(
+                "Unable to listen for uevents: {}", std::string(strerror(errno))));
+        }
+    }
+
+    /**
+        Waits up to `timeoutMs` (-1: forever) for a whole disk being added
+        that matches one of `rules` and is not mounted. Returns its node,
+        e.g. "/dev/sdb", or nothing on timeout.
+    */
+    std::optional<std::string> next(const std::vector<HotplugRule> &rules,
+                                    int timeoutMs = -1) {
+        const auto deadline = std::chrono::steady_clock::now() +
+                              std::chrono::milliseconds(timeoutMs);
+        std::array<char, 8192> buff;
+        for (;;) {
+            auto wait = timeoutMs;
+            if (timeoutMs >= 0) {
+                wait = int(std::max<int64_t>(
+                    0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count()));
+            }
+            pollfd pfd{sock.get(), POLLIN, 0};
+            const auto ready = ::poll(&pfd, 1, wait);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready < 0) {
+                throw std::runtime_error(std::format(
+                    "poll failed: {}", std::string(strerror(errno))));
+            }
+            if (ready == 0)
+                return std::nullopt;
+
+            const auto len = ::recv(sock.get(), buff.data(), buff.size(), 0);
+            if (len <= 0)
+                continue;
+            auto props = detail::hotplug::parseUevent(buff.data(), len);
+            if (props["ACTION"] != "add" || props["SUBSYSTEM"] != "block" ||
+                props["DEVTYPE"] != "disk" || props["DEVNAME"].empty())
+                continue;
+
+            auto devName = props["DEVNAME"];
+            if (devName.starts_with("/dev/"))
+                devName = devName.substr(5);
+            const auto sysfs = std::filesystem::path("/sys") /
+                               std::filesystem::path(props["DEVPATH"])
+                                   .relative_path();
+            const auto match = std::ranges::any_of(rules, [&](const auto &rule) {
+                return detail::hotplug::matches(rule, sysfs);
+            });
+            if (match && !detail::hotplug::mounted(devName))
+                return "/dev/" + devName;
+        }
+    }
+
+  private:
+    detail::FileDescriptor sock;
+};
+
+struct HotplugResult {
+    std::string device;
+    // from the uevent to the first completed write
+    double firstWriteMs = 0;
+    CopyStats stats;
+    // set if the flash failed
+    std::exception_ptr error;
+};
+
+/**
+    Flashes `bmapFile` from `source` onto every device matching the rules
+    of `options` as it is plugged in. Everything that does not depend on
+    the device is done up front: the bmap is parsed, the first
+    `prefetchChunks` chunks are read into memory and the event socket is
+    open, so the first write follows the event within milliseconds.
+    Devices are flashed in parallel if `source` can be read concurrently and
+    one after the other otherwise; `done` is called as each finishes (from
+    the flashing thread). Returns after `maxDevices` devices or when
+    `stop` becomes true (checked every 200 ms).
+*/
+inline void flash_on_hotplug(
+    Source &source, const BmapFile &bmapFile, const HotplugOptions &options,
+    const CopyOptions &copyOptions,
+    const std::function<void(const HotplugResult &)> &done,
+    const std::atomic<bool> *stop = nullptr) {
+    if (options.rules.empty()) {
+        throw std::runtime_error("Hotplug flashing needs at least one rule");
+    }
+    if (!bmapFile.normalized()) {
+        auto normalized = bmapFile;
+        normalized.normalize();
+        flash_on_hotplug(source, normalized, options, copyOptions, done, stop);
+        return;
+    }
+
+    // the prefetched chunks only line up with a fixed I/O size
+    auto copyOpts = copyOptions;
+    copyOpts.adaptive = false;
+    PrefetchedSource prefetched(source, bmapFile, copyOpts.ioSize,
+                                options.prefetchChunks);
+    HotplugMonitor monitor(options.udevEvents);
+    // held for the whole copy if the flashes can't share the source
+    std::mutex serial;
+
+    // declared last, so an exception from the monitor joins the running
+    // flashes before the state they share is destroyed
+    std::vector<std::jthread> flashes;
+    for (size_t count = 0;
+         (options.maxDevices == 0 || count < options.maxDevices) &&
+         !(stop && *stop);) {
+        const auto device = monitor.next(options.rules, 200);
+        if (!device)
+            continue;
+        count++;
+        const auto plugged = std::chrono::steady_clock::now();
+        flashes.emplace_back([&, device = *device, plugged]() {
+            HotplugResult result;
+            result.device = device;
+            std::unique_lock lock(serial, std::defer_lock);
+            if (!prefetched.concurrentReads())
+                lock.lock();
+            try {
+                FileSink sink(device, copyOpts);
+                bool first = true;
+                result.stats = copy(
+                    prefetched, bmapFile, sink,
+                    [&](const Progress &) {
+                        if (!first)
+                            return;
+                        first = false;
+                        result.firstWriteMs =
+                            std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - plugged)
+                                .count();
+                    },
+                    copyOpts);
+            } catch (...) {
+                result.error = std::current_exception();
+            }
+            if (lock.owns_lock())
+                lock.unlock();
+            if (done)
+                done(result);
+        });
+    }
+    for (auto &flash : flashes)
+        flash.join();
+}
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,508 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_HTTP_H
+#define BMAP_HTTP_H
+
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct HttpOptions {
+    // parallel keep-alive connections to the server
+    size_t connections = 4;
+    // bytes per range request, reads larger than this are split
+    size_t requestSize = 1024 * 1024;
+    // requests sent on a connection before the first response is read
+    size_t pipelineDepth = 4;
+    int timeoutSeconds = 30;
+    // reconnects per read after the server dropped the connection
+    size_t retries = 3;
+};
+
+namespace detail {
+
+// the connection broke, the request can be retried on a new one
+struct HttpConnectionError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct Url {
+    std::string host;
+    std::string port = "80";
+    std::string path = "/";
+
+    static Url parse(const std::string &url) {
+        constexpr auto scheme = std::string_view("http://");
+        if (!url.starts_with(scheme)) {
+            throw std::runtime_error(std::format(
+                "Unsupported URL {}: only http:// is supported", url));
+        }
+        Url result;
+        auto authority = url.substr(scheme.size());
+        if (const auto slash = authority.find('/');
+            slash != std::string::npos) {
+            result.path = authority.substr(slash);
+            authority.resize(slash);
+        }
+        // [v6 address]:port
+        const auto bracket = authority.rfind(']');
+        const auto colon = authority.rfind(':');
+        if (colon != std::string::npos &&
+            (bracket == std::string::npos || colon > bracket)) {
+            result.port = authority.substr(colon + 1);
+            authority.resize(colon);
+        }
+        if (authority.starts_with('[') && authority.ends_with(']'))
+            authority = authority.substr(1, authority.size() - 2);
+        if (authority.empty() || result.port.empty()) {
+            throw std::runtime_error(std::format("Invalid URL {}", url));
+        }
+        result.host = authority;
+        return result;
+    }
+
+    std::string hostHeader() const {
+        const auto host =
+            this->host.find(':') != std::string::npos ? "[" + this->host + "]"
+                                                      : this->host;
+        return port == "80" ? host : host + ":" + port;
+    }
+};
+
+/**
+    Blocking HTTP/1.1 client connection with a small receive buffer.
+*/
+class HttpConnection {
+  public:
+    HttpConnection(const Url &url, int timeoutSeconds)
+        : sock(connect(url, timeoutSeconds)), buffer(64 * 1024) {}
+
+    void send(const std::string &data) {
+        for (size_t sent = 0; sent < data.size();) {
+            const auto ret = ::send(sock.get(), data.data() + sent,
+                                    data.size() - sent, MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                throw HttpConnectionError(std::format(
+                    "HTTP send failed: {}", std::string(std::strerror(errno))));
+            }
+            sent += ret;
+        }
+    }
+
+    // returns 0 at the end of the stream
+    size_t readSome(uint8_t *buf, size_t len) {
+        if (pos == end) {
+            // large reads go straight to the caller's buffer
+            if (len >= buffer.size())
+                return recv(buf, len);
+            pos = 0;
+            end = recv(buffer.data(), buffer.size());
+        }
+        const auto count = std::min(len, end - pos);
+        std::memcpy(buf, buffer.data() + pos, count);
+        pos += count;
+        return count;
+    }
+
+    void readExact(uint8_t *buf, size_t len) {
+        for (size_t done = 0; done < len;) {
+            const auto count = readSome(buf + done, len - done);
+            if (count == 0) {
+                throw HttpConnectionError("HTTP connection closed by server");
+            }
+            done += count;
+        }
+    }
+
+    void discard(size_t len) {
+        std::array<uint8_t, 4096> scratch;
+        for (; len > 0;) {
+            const auto count = std::min(len, scratch.size());
+            readExact(scratch.data(), count);
+            len -= count;
+        }
+    }
+
+    std::string readLine() {
+        std::string line;
+        for (uint8_t c = 0; c != '\n';) {
+            readExact(&c, 1);
+            line += char(c);
+            if (line.size() > 16 * 1024) {
+                throw std::runtime_error("HTTP header line too long");
+            }
+        }
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        return line;
+    }
+
+  private:
+    static int connect(const Url &url, int timeoutSeconds) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        if (const auto ret = ::getaddrinfo(url.host.c_str(), url.port.c_str(),
+                                           &hints, &addresses);
+            ret != 0) {
+            throw std::runtime_error(
+                std::format("Unable to resolve {}: {}", url.host,
+                            std::string(::gai_strerror(ret))));
+        }
+        std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> guard(
+            addresses, ::freeaddrinfo);
+
+        auto error = 0;
+        for (auto *addr = addresses; addr != nullptr; addr = addr->ai_next) {
+            const auto fd = ::socket(addr->ai_family,
+                                     addr->ai_socktype | SOCK_CLOEXEC,
+                                     addr->ai_protocol);
+            if (fd < 0) {
+                error = errno;
+                continue;
+            }
+            const timeval timeout{timeoutSeconds, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            const int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (::connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+                return fd;
+            error = errno;
+            ::close(fd);
+        }
+        throw HttpConnectionError(
+            std::format("Unable to connect to {}:{}: {}", url.host, url.port,
+                        std::string(std::strerror(error))));
+    }
+
+    size_t recv(void *buf, size_t len) {
+        for (;;) {
+            const auto ret = ::recv(sock.get(), buf, len, 0);
+            if (ret >= 0)
+                return ret;
+            if (errno != EINTR) {
+                throw HttpConnectionError(std::format(
+                    "HTTP receive failed: {}", std::string(std::strerror(errno))));
+            }
+        }
+    }
+
+    FileDescriptor sock;
+    std::vector<uint8_t> buffer;
+    size_t pos = 0;
+    size_t end = 0;
+};
+
+struct HttpResponse {
+    int status = 0;
+    std::optional<size_t> contentLength;
+    std::string contentRange;
+    bool chunked = false;
+    // the server closes the connection after this response
+    bool close = false;
+
+    static HttpResponse read(HttpConnection &connection) {
+        HttpResponse response;
+        do {
+            const auto statusLine = connection.readLine();
+            // "HTTP/1.1 206 Partial Content"
+            const auto space = statusLine.find(' ');
+            if (!statusLine.starts_with("HTTP/") || space == std::string::npos) {
+                throw std::runtime_error(
+                    std::format("Invalid HTTP status line '{}'", statusLine));
+            }
+            response.status = std::atoi(statusLine.c_str() + space + 1);
+            response.close = statusLine.starts_with("HTTP/1.0");
+
+            for (auto line = connection.readLine(); !line.empty();
+                 line = connection.readLine()) {
+                const auto colon = line.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                auto name = line.substr(0, colon);
+                std::ranges::transform(name, name.begin(), [](unsigned char c) {
+                    return std::tolower(c);
+                });
+                auto value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                if (name == "content-length") {
+                    response.contentLength = std::stoull(value);
+                } else if (name == "content-range") {
+                    response.contentRange = value;
+                } else if (name == "transfer-encoding") {
+                    response.chunked = value.find("chunked") != std::string::npos;
+                } else if (name == "connection") {
+                    std::ranges::transform(value, value.begin(),
+                                           [](unsigned char c) {
+                                               return std::tolower(c);
+                                           });
+                    response.close = value.find("close") != std::string::npos;
+                }
+            }
+            // skip "100 Continue" and friends
+        } while (response.status >= 100 && response.status < 200);
+        return response;
+    }
+
+    // first byte of "bytes first-last/size"
+    std::optional<size_t> rangeStart() const {
+        if (!contentRange.starts_with("bytes "))
+            return std::nullopt;
+        return std::stoull(contentRange.substr(6));
+    }
+
+    std::vector<char> body(HttpConnection &connection) const {
+        std::vector<char> data;
+        const auto append = [&](size_t len) {
+            const auto size = data.size();
+            data.resize(size + len);
+            connection.readExact(reinterpret_cast<uint8_t *>(data.data() + size),
+                                 len);
+        };
+        if (chunked) {
+            for (;;) {
+                const auto size = std::stoull(connection.readLine(), nullptr, 16);
+                if (size == 0)
+                    break;
+                append(size);
+                connection.readLine();
+            }
+            // trailers
+            while (!connection.readLine().empty()) {
+            }
+        } else if (contentLength) {
+            append(*contentLength);
+        } else {
+            // HTTP/1.0 style, the body ends with the connection
+            std::array<uint8_t, 4096> buf;
+            for (size_t count; (count = connection.readSome(buf.data(), buf.size())) > 0;)
+                data.insert(data.end(), buf.begin(), buf.begin() + count);
+        }
+        return data;
+    }
+
+    void discardBody(HttpConnection &connection) const {
+        if (chunked || !contentLength) {
+            body(connection);
+        } else {
+            connection.discard(*contentLength);
+        }
+    }
+};
+
+} // namespace detail
+
+/**
+    Source for an image on an HTTP/1.1 server. Only the ranges the copy
+    engine asks for are fetched with Range requests, so unmapped space is
+    never downloaded. read() may be called concurrently, each caller borrows
+    one of up to `connections` keep-alive connections and pipelines
+    `pipelineDepth` requests of `requestSize` bytes on it. Use it with
+    CopyOptions::readAhead so several chunks are in flight:
+
+        bmap::HttpSource source("http://server/image.wic");
+        const auto bmapFile = bmap::BmapFile::from_xml_data(
+            bmap::HttpSource::fetch("http://server/image.wic.bmap"));
+*/
+class HttpSource : public Source {
+  public:
+    struct Statistics {
+        size_t requests = 0;
+        size_t connections = 0;
+        size_t bytes = 0;
+    };
+
+    explicit HttpSource(const std::string &url, const HttpOptions &options = {})
+        : url(url), parsedUrl(detail::Url::parse(url)), options(options) {
+        this->options.connections = std::max<size_t>(1, options.connections);
+        this->options.requestSize = std::max<size_t>(1, options.requestSize);
+        this->options.pipelineDepth = std::max<size_t>(1, options.pipelineDepth);
+    }
+
+    /**
+        Downloads a whole resource, e.g. the bmap file next to the image.
+    */
+    static std::vector<char> fetch(const std::string &url,
+                                   const HttpOptions &options = {}) {
+        const auto parsed = detail::Url::parse(url);
+        detail::HttpConnection connection(parsed, options.timeoutSeconds);
+        connection.send(std::format("GET {} HTTP/1.1\r\nHost: {}\r\n"
+                                    "User-Agent: bmap-cpp\r\n"
+                                    "Connection: close\r\n\r\n",
+                                    parsed.path, parsed.hostHeader()));
+        const auto response = detail::HttpResponse::read(connection);
+        if (response.status != 200) {
+            throw std::runtime_error(std::format(
+                "HTTP {} for {}", std::to_string(response.status), url));
+        }
+        return response.body(connection);
+    }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        auto connection = acquire();
+        try {
+            const auto count = readRanges(connection, offset, buf, len);
+            release(std::move(connection));
+            return count;
+        } catch (...) {
+            release(nullptr);
+            throw;
+        }
+    }
+
+    bool concurrentReads() const override { return true; }
+
+    Statistics statistics() const {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+  private:
+    using Connection = std::unique_ptr<detail::HttpConnection>;
+
+    Connection acquire() {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this]() {
+            return !idle.empty() || open < options.connections;
+        });
+        if (!idle.empty()) {
+            auto connection = std::move(idle.back());
+            idle.pop_back();
+            return connection;
+        }
+        open++;
+        lock.unlock();
+        try {
+            return connect();
+        } catch (...) {
+            release(nullptr);
+            throw;
+        }
+    }
+
+    // nullptr gives up the slot of a broken connection
+    void release(Connection connection) {
+        {
+            std::lock_guard lock(mutex);
+            if (connection) {
+                idle.push_back(std::move(connection));
+            } else {
+                open--;
+            }
+        }
+        cv.notify_one();
+    }
+
+    Connection connect() {
+        auto connection = std::make_unique<detail::HttpConnection>(
+            parsedUrl, options.timeoutSeconds);
+        std::lock_guard lock(mutex);
+        stats.connections++;
+        return connection;
+    }
+
+    size_t readRanges(Connection &connection, size_t offset, uint8_t *buf,
+                      size_t len) {
+        const auto pieces = (len + options.requestSize - 1) / options.requestSize;
+        size_t sent = 0;
+        size_t received = 0;
+        size_t retries = 0;
+        size_t total = 0;
+        bool eof = false;
+
+        while (received < pieces) {
+            try {
+                if (!connection) {
+                    connection = connect();
+                    sent = received;
+                }
+                for (; sent < pieces && sent - received < options.pipelineDepth;
+                     sent++) {
+                    const auto first = offset + sent * options.requestSize;
+                    const auto last =
+                        std::min(offset + len, first + options.requestSize) - 1;
+                    connection->send(std::format(
+                        "GET {} HTTP/1.1\r\nHost: {}\r\n"
+                        "User-Agent: bmap-cpp\r\nRange: bytes={}-{}\r\n\r\n",
+                        parsedUrl.path, parsedUrl.hostHeader(),
+                        std::to_string(first), std::to_string(last)));
+                }
+
+                const auto response = detail::HttpResponse::read(*connection);
+                const auto first = offset + received * options.requestSize;
+                const auto expected =
+                    std::min(offset + len, first + options.requestSize) - first;
+                if (response.status == 416) {
+                    // range starts past the end of the image
+                    response.discardBody(*connection);
+                    eof = true;
+                } else if (response.status == 206) {
+                    if (response.rangeStart() != first || !response.contentLength ||
+                        *response.contentLength > expected) {
+                        throw std::runtime_error(std::format(
+                            "Unexpected Content-Range '{}' from {}",
+                            response.contentRange, url));
+                    }
+                    const auto count = *response.contentLength;
+                    connection->readExact(buf + (first - offset), count);
+                    if (!eof)
+                        total += count;
+                    // the last block of the image may be partial
+                    eof = eof || count < expected;
+                } else if (response.status == 200) {
+                    throw std::runtime_error(std::format(
+                        "Server does not support range requests for {}", url));
+                } else {
+                    throw std::runtime_error(std::format(
+                        "HTTP {} for {}", std::to_string(response.status), url));
+                }
+                received++;
+                retries = 0;
+                {
+                    std::lock_guard lock(mutex);
+                    stats.requests++;
+                    stats.bytes += response.contentLength.value_or(0);
+                }
+                if (response.close)
+                    connection.reset();
+            } catch (const detail::HttpConnectionError &) {
+                // idle keep-alive connections get dropped by servers,
+                // resend what is outstanding on a new one
+                connection.reset();
+                if (++retries > options.retries)
+                    throw;
+            }
+        }
+        return total;
+    }
+
+    std::string url;
+    detail::Url parsedUrl;
+    HttpOptions options;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Connection> idle;
+    size_t open = 0;
+    Statistics stats;
+};
+
+} // namespace bmap
+
+#endif
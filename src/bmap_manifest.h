@@ -0,0 +1,381 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_MANIFEST_H
+#define BMAP_MANIFEST_H
+
+#include <cctype>
+#include <memory>
+#include <numeric>
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct ManifestEntry {
+    std::string imagePath;
+    std::string bmapPath;
+    // byte offset of the image on the target
+    size_t targetOffset;
+};
+
+/**
+    Several images, each with its own bmap, written to one device at
+    different offsets, e.g. separate boot, rootfs and data partitions.
+
+    File format, one image per line, relative paths are relative to the
+    manifest. Offsets are bytes with an optional K, M or G suffix (1024
+    based), '#' starts a comment:
+
+        # image        bmap                offset
+        boot.vfat      boot.vfat.bmap      4M
+        rootfs.ext4    rootfs.ext4.bmap    260M
+*/
+struct Manifest {
+    std::vector<ManifestEntry> entries;
+
+    static Manifest from_file(const std::string &path) {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error(
+                std::format("Unable to open manifest {}", path));
+        }
+        const auto base = std::filesystem::path(path).parent_path();
+        const auto resolve = [&](const std::string &p) {
+            const auto fsPath = std::filesystem::path(p);
+            return (fsPath.is_absolute() ? fsPath : base / fsPath).string();
+        };
+
+        Manifest manifest;
+        size_t lineNo = 0;
+        for (std::string line; std::getline(file, line);) {
+            lineNo++;
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string image, bmapPath, offset;
+            if (!(fields >> image))
+                continue;
+            if (!(fields >> bmapPath >> offset)) {
+                throw std::runtime_error(std::format(
+                    "Manifest line {}: expected 'image bmap offset'",
+                    std::to_string(lineNo)));
+            }
+            manifest.entries.push_back(
+                {resolve(image), resolve(bmapPath), parseSize(offset, lineNo)});
+        }
+        return manifest;
+    }
+
+  private:
+    static size_t parseSize(const std::string &text, size_t lineNo) {
+        size_t pos = 0;
+        size_t value = 0;
+        try {
+            value = std::stoull(text, &pos);
+        } catch (const std::exception &) {
+            pos = 0;
+        }
+        const auto suffix = text.substr(pos);
+        if (pos == 0 || suffix.size() > 1) {
+            throw std::runtime_error(std::format("Manifest line {}: invalid offset '{}'",
+                                                 std::to_string(lineNo), text));
+        }
+        if (suffix.empty())
+            return value;
+        switch (std::toupper(suffix[0])) {
+        case 'K':
+            return value << 10;
+        case 'M':
+            return value << 20;
+        case 'G':
+            return value << 30;
+        }
+        throw std::runtime_error(std::format("Manifest line {}: invalid offset '{}'",
+                                             std::to_string(lineNo), text));
+    }
+};
+
+namespace detail {
+// image size rounded up to whole blocks
+inline size_t paddedSize(const BmapFile &bmapFile) {
+    return (bmapFile.imageSize + bmapFile.blockSize - 1) / bmapFile.blockSize *
+           bmapFile.blockSize;
+}
+} // namespace detail
+
+/**
+    Source for the combined schedule of a manifest. Every image gets a reader
+    thread that reads its ranges ahead in schedule order, so the sources are
+    read concurrently while the copy engine consumes them in target order.
+*/
+class ManifestSource : public Source {
+  public:
+    // part of one image placed on the target
+    struct Segment {
+        size_t targetOffset;
+        size_t length;
+        size_t source;
+        size_t sourceOffset;
+    };
+
+    ManifestSource(std::vector<std::unique_ptr<Source>> sources,
+                   std::vector<Segment> segments, size_t chunkSize,
+                   size_t readAhead)
+        : sources(std::move(sources)), segments(std::move(segments)),
+          streams(this->sources.size()) {
+        std::sort(this->segments.begin(), this->segments.end(),
+                  [](const auto &a, const auto &b) {
+                      return a.targetOffset < b.targetOffset;
+                  });
+        for (size_t idx = 0; idx < streams.size(); idx++) {
+            streams[idx].readAhead = std::max<size_t>(1, readAhead);
+            streams[idx].thread =
+                std::thread([this, idx, chunkSize]() { prefetch(idx, chunkSize); });
+        }
+    }
+
+    ~ManifestSource() override {
+        for (auto &stream : streams) {
+            {
+                std::lock_guard lock(stream.mutex);
+                stream.stopping = true;
+            }
+            stream.cv.notify_all();
+        }
+        for (auto &stream : streams)
+            stream.thread.join();
+    }
+
+    /**
+        Reads across consecutive segments; stops early only where no image
+        continues, i.e. at the end of an image inside its last block.
+    */
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        size_t done = 0;
+        while (done < len) {
+            const auto pos = offset + done;
+            const auto it = std::partition_point(
+                segments.begin(), segments.end(), [&](const auto &segment) {
+                    return segment.targetOffset + segment.length <= pos;
+                });
+            if (it == segments.end() || it->targetOffset > pos) {
+                if (done > 0)
+                    break;
+                throw std::runtime_error(std::format(
+                    "Offset {} is not mapped by any image of the manifest",
+                    std::to_string(offset)));
+            }
+
+            const auto wanted =
+                std::min(len - done, it->targetOffset + it->length - pos);
+            if (readSegment(*it, pos, buf + done, wanted) < wanted) {
+                throw std::runtime_error(std::format(
+                    "Image {} of the manifest ends before offset {}",
+                    std::to_string(it->source + 1),
+                    std::to_string(it->sourceOffset + it->length)));
+            }
+            done += wanted;
+        }
+        return done;
+    }
+
+  private:
+    struct Chunk {
+        size_t targetOffset;
+        std::vector<uint8_t> data;
+    };
+
+    struct Stream {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Chunk> chunks;
+        size_t readAhead = 1;
+        bool stopping = false;
+        bool finished = false;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    // reads [pos, pos + len) of `segment`, from the read-ahead stream where
+    // possible
+    size_t readSegment(const Segment &segment, size_t offset, uint8_t *buf,
+                       size_t len) {
+        auto &stream = streams[segment.source];
+        size_t done = 0;
+        while (done < len) {
+            std::unique_lock lock(stream.mutex);
+            stream.cv.wait(lock, [&]() {
+                return !stream.chunks.empty() || stream.error || stream.finished;
+            });
+            if (stream.error)
+                std::rethrow_exception(stream.error);
+
+            // drop what the engine did not ask for
+            while (!stream.chunks.empty() &&
+                   stream.chunks.front().targetOffset +
+                           stream.chunks.front().data.size() <=
+                       offset + done) {
+                stream.chunks.pop_front();
+                stream.cv.notify_all();
+            }
+            if (stream.chunks.empty()) {
+                if (!stream.finished)
+                    continue;
+                break;
+            }
+            const auto &chunk = stream.chunks.front();
+            if (chunk.targetOffset > offset + done) {
+                // not read ahead, e.g. the engine skipped around
+                lock.unlock();
+                const auto pos = offset + done;
+                const auto wanted = std::min(len - done, chunk.targetOffset - pos);
+                const auto count = sources[segment.source]->read(
+                    segment.sourceOffset + (pos - segment.targetOffset),
+                    buf + done, wanted);
+                done += count;
+                if (count < wanted)
+                    break;
+                continue;
+            }
+            const auto skip = offset + done - chunk.targetOffset;
+            const auto count = std::min(len - done, chunk.data.size() - skip);
+            std::memcpy(buf + done, chunk.data.data() + skip, count);
+            done += count;
+        }
+        return done;
+    }
+
+    void prefetch(size_t idx, size_t chunkSize) {
+        auto &stream = streams[idx];
+        try {
+            for (const auto &segment : segments) {
+                if (segment.source != idx)
+                    continue;
+                for (size_t done = 0; done < segment.length;) {
+                    const auto len = std::min(chunkSize, segment.length - done);
+                    std::vector<uint8_t> data(len);
+                    data.resize(sources[idx]->read(segment.sourceOffset + done,
+                                                   data.data(), len));
+
+                    std::unique_lock lock(stream.mutex);
+                    stream.cv.wait(lock, [&]() {
+                        return stream.stopping ||
+                               stream.chunks.size() < stream.readAhead;
+                    });
+                    if (stream.stopping)
+                        return;
+                    if (data.empty())
+                        break;
+                    stream.chunks.push_back(
+                        Chunk{segment.targetOffset + done, std::move(data)});
+                    stream.cv.notify_all();
+                    done += len;
+                }
+            }
+            std::lock_guard lock(stream.mutex);
+            stream.finished = true;
+        } catch (...) {
+            std::lock_guard lock(stream.mutex);
+            stream.error = std::current_exception();
+        }
+        stream.cv.notify_all();
+    }
+
+    std::vector<std::unique_ptr<Source>> sources;
+    std::vector<Segment> segments;
+    std::vector<Stream> streams;
+};
+
+/**
+    Writes all images of `manifest` to `targetDisk`. The ranges of all bmaps
+    are merged into one schedule sorted by target offset, so the device sees
+    mostly sequential writes while the images are read concurrently.
+    All bmaps need the same block size and checksum type and every target
+    offset has to be a multiple of the block size. Images must not overlap
+    on the target.
+*/
+inline CopyStats copy(const Manifest &manifest, const std::string &targetDisk,
+                      const ProgressCallback &callback = nullptr,
+                      const CopyOptions &options = {}) {
+    if (manifest.entries.empty()) {
+        throw std::runtime_error("Manifest has no images");
+    }
+
+    std::vector<BmapFile> bmaps;
+    for (const auto &entry : manifest.entries)
+        bmaps.push_back(BmapFile::from_xml(entry.bmapPath));
+
+    const auto blockSize = bmaps.front().blockSize;
+    BmapFile combined{0, blockSize, 0, 0, bmaps.front().checksumType, "", {}};
+    std::vector<ManifestSource::Segment> segments;
+    std::vector<std::unique_ptr<Source>> sources;
+
+    for (size_t idx = 0; idx < bmaps.size(); idx++) {
+        const auto &entry = manifest.entries[idx];
+        const auto &bmapFile = bmaps[idx];
+        if (bmapFile.blockSize != blockSize) {
+            throw std::runtime_error(
+                std::format("{} has a different block size", entry.bmapPath));
+        }
+        if (entry.targetOffset % blockSize != 0) {
+            throw std::runtime_error(std::format(
+                "Offset of {} is not a multiple of the block size",
+                entry.imagePath));
+        }
+        if (bmapFile.checksumType != combined.checksumType) {
+            // the combined bmap is verified with a single checksum type
+            throw std::runtime_error(std::format(
+                "{} uses checksum type '{}', {} '{}'", entry.bmapPath,
+                bmapFile.checksumType, manifest.entries.front().bmapPath,
+                combined.checksumType));
+        }
+
+        const auto blockOffset = entry.targetOffset / blockSize;
+        for (const auto &range : bmapFile.blockMap) {
+            const auto sourceOffset = range.offset * blockSize;
+            if (sourceOffset >= bmapFile.imageSize)
+                continue;
+            combined.blockMap.push_back(Range{range.offset + blockOffset,
+                                              range.blockCount,
+                                              range.checksum});
+            const auto length = std::min(range.blockCount * blockSize,
+                                         bmapFile.imageSize - sourceOffset);
+            segments.push_back(ManifestSource::Segment{
+                entry.targetOffset + sourceOffset, length, idx, sourceOffset});
+        }
+        combined.mappedBlocksCount += bmapFile.mappedBlocksCount;
+        combined.imageSize = std::max(combined.imageSize,
+                                      entry.targetOffset + bmapFile.imageSize);
+        sources.push_back(std::make_unique<FileSource>(entry.imagePath));
+    }
+    combined.blocksCount = (combined.imageSize + blockSize - 1) / blockSize;
+
+    // whole images, not only their mapped ranges: unmapped blocks of one
+    // image are still part of it
+    std::vector<size_t> order(manifest.entries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return manifest.entries[a].targetOffset < manifest.entries[b].targetOffset;
+    });
+    for (size_t idx = 1; idx < order.size(); idx++) {
+        const auto &prev = manifest.entries[order[idx - 1]];
+        const auto &next = manifest.entries[order[idx]];
+        if (prev.targetOffset + detail::paddedSize(bmaps[order[idx - 1]]) >
+            next.targetOffset) {
+            throw std::runtime_error(std::format("{} and {} overlap on the target",
+                                                 prev.imagePath, next.imagePath));
+        }
+    }
+    std::sort(combined.blockMap.begin(), combined.blockMap.end(),
+              [](const auto &a, const auto &b) { return a.offset < b.offset; });
+
+    ManifestSource source(std::move(sources), std::move(segments),
+                          std::min(options.ioSize, MAX_BUF_SIZE),
+                          std::max<size_t>(2, options.queueDepth * 2));
+    FileSink sink(targetDisk, options);
+    return copy(source, combined, sink, callback, options);
+}
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,314 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_MMAP_H
+#define BMAP_MMAP_H
+
+#include <map>
+#include <memory>
+
+#include <sys/mman.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+/**
+    Experimental sink that writes through shared mappings of the target
+    instead of pwrite. The target is mapped in windows of `windowSize`
+    bytes, at most `maxWindows` at a time; the least recently used one is
+    written back with msync(MS_SYNC) and unmapped to make room. sync()
+    flushes the live ones and fsyncs the target.
+
+    Writing past the end of a mapped file raises SIGBUS, so the target has
+    to be at least `minSize` bytes large. Smaller regular files are
+    extended, smaller devices are an error.
+*/
+class MmapSink : public Sink {
+  public:
+    explicit MmapSink(const std::string &path, size_t minSize,
+                      size_t windowSize = 64 * 1024 * 1024, size_t maxWindows = 4)
+        : file(::open(path.c_str(), O_RDWR)),
+          windowSize(std::max<size_t>(
+              ::sysconf(_SC_PAGESIZE),
+              windowSize / ::sysconf(_SC_PAGESIZE) * ::sysconf(_SC_PAGESIZE))),
+          maxWindows(std::max<size_t>(1, maxWindows)) {
+        if (file.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open {} for writing: {}", path, strerror(errno)));
+        }
+        struct stat st;
+        if (::fstat(file.get(), &st) != 0) {
+            throw std::runtime_error(std::format("Unable to stat {}", path));
+        }
+        size = st.st_size;
+        if (S_ISBLK(st.st_mode)) {
+            uint64_t bytes = 0;
+            if (::ioctl(file.get(), BLKGETSIZE64, &bytes) == 0)
+                size = bytes;
+        } else if (S_ISREG(st.st_mode) && size < minSize) {
+            if (::ftruncate(file.get(), minSize) != 0) {
+                throw std::runtime_error(std::format(
+                    "Unable to extend {} to {} bytes: {}", path,
+                    std::to_string(minSize), std::string(strerror(errno))));
+            }
+            size = minSize;
+        }
+        if (size < minSize) {
+            throw std::runtime_error(std::format(
+                "{} is too small ({} bytes, {} needed)", path,
+                std::to_string(size), std::to_string(minSize)));
+        }
+    }
+
+    ~MmapSink() override {
+        std::lock_guard lock(mutex);
+        windows.clear();
+    }
+
+    /**
+        Lets `produce(dst, done, count)` fill [offset, offset + len) straight
+        in the mapping, window by window, without an intermediate buffer.
+        `produce` returns the bytes it wrote, fewer end the fill. Returns the
+        total.
+    */
+    template <typename Producer>
+    size_t fill(size_t offset, size_t len, Producer &&produce) {
+        if (offset > size || len > size - offset) {
+            throw std::runtime_error(std::format(
+                "Write at {} past the end of the target", std::to_string(offset)));
+        }
+        size_t done = 0;
+        while (done < len) {
+            const auto pos = offset + done;
+            const auto window = acquire(pos / windowSize);
+            const auto start = pos - window->offset;
+            const auto count = std::min(len - done, window->length - start);
+            const auto written = produce(window->data + start, done, count);
+            done += written;
+            if (written < count)
+                break;
+        }
+        return done;
+    }
+
+    void write(size_t offset, const uint8_t *buf, size_t len) override {
+        fill(offset, len, [&](uint8_t *dst, size_t done, size_t count) {
+            std::memcpy(dst, buf + done, count);
+            return count;
+        });
+    }
+
+    void zero(size_t offset, size_t len) override {
+        fill(offset, len, [](uint8_t *dst, size_t, size_t count) {
+            std::memset(dst, 0, count);
+            return count;
+        });
+    }
+
+    void sync() override {
+        {
+            std::lock_guard lock(mutex);
+            for (const auto &[idx, window] : windows) {
+                if (::msync(window->data, window->length, MS_SYNC) != 0) {
+                    throw std::runtime_error(std::format(
+                        "msync failed: {}", std::string(strerror(errno))));
+                }
+            }
+        }
+        if (::fsync(file.get()) != 0) {
+            throw std::runtime_error(
+                std::format("fsync failed: {}", std::string(strerror(errno))));
+        }
+    }
+
+  private:
+    struct Window {
+        uint8_t *data;
+        size_t offset;
+        size_t length;
+
+        Window(uint8_t *data, size_t offset, size_t length)
+            : data(data), offset(offset), length(length) {}
+        Window(const Window &) = delete;
+        Window &operator=(const Window &) = delete;
+
+        // unmapping keeps the written pages in the page cache
+        ~Window() { ::munmap(data, length); }
+
+        // for the LRU eviction
+        size_t lastUse = 0;
+    };
+
+    // writers keep the window alive while they copy into it, evicting only
+    // drops the sink's reference
+    std::shared_ptr<Window> acquire(size_t idx) {
+        std::lock_guard lock(mutex);
+        if (const auto it = windows.find(idx); it != windows.end()) {
+            it->second->lastUse = ++uses;
+            return it->second;
+        }
+
+        const auto offset = idx * windowSize;
+        const auto length = std::min(windowSize, size - offset);
+        const auto data = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, file.get(), offset);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error(std::format(
+                "Unable to map the target at {}: {}", std::to_string(offset),
+                std::string(strerror(errno))));
+        }
+        auto window = std::make_shared<Window>(static_cast<uint8_t *>(data),
+                                               offset, length);
+        while (windows.size() >= maxWindows) {
+            const auto lru = std::ranges::min_element(
+                windows, {}, [](const auto &entry) { return entry.second->lastUse; });
+            // written back here bounds the dirty pages to the live windows
+            if (::msync(lru->second->data, lru->second->length, MS_SYNC) != 0) {
+                throw std::runtime_error(std::format(
+                    "msync failed: {}", std::string(strerror(errno))));
+            }
+            windows.erase(lru);
+        }
+        window->lastUse = ++uses;
+        windows.emplace(idx, window);
+        return window;
+    }
+
+    detail::FileDescriptor file;
+    const size_t windowSize;
+    const size_t maxWindows;
+    size_t size = 0;
+    std::mutex mutex;
+    std::map<size_t, std::shared_ptr<Window>> windows;
+    size_t uses = 0;
+};
+
+/**
+    Copy variant for MmapSink: the source reads (or decompresses) every
+    chunk straight into the mapped target and the checksums are calculated
+    from there, so the data is never staged in a buffer. Runs on the
+    calling thread; `ioSize`, `verifyChecksums`, `flushMode` and `trace` of
+    `options` apply. Auto flushes once at the end, the sink writes back
+    every window it unmaps; Fua is done as Range. Options that need the
+    write queue or a write path (`queueDepth`, `adaptive`, `readAhead`,
+    `directIo`, `zeroChunks`) are rejected.
+*/
+inline CopyStats copy_mapped(Source &source, const BmapFile &bmapFile,
+                             MmapSink &sink,
+                             const ProgressCallback &callback = nullptr,
+                             const CopyOptions &options = {}) {
+    if (!bmapFile.normalized()) {
+        auto normalized = bmapFile;
+        normalized.normalize();
+        return copy_mapped(source, normalized, sink, callback, options);
+    }
+
+    if (options.queueDepth > 1 || options.adaptive || options.readAhead > 0 ||
+        options.directIo ||
+        options.zeroChunks != CopyOptions::ZeroChunks::Write) {
+        throw std::runtime_error(
+            "Writing through mappings supports no queue depth, adaptive "
+            "sizing, read-ahead, direct I/O or zero chunk handling");
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    const TraceRecorder::Scope traceScope(options.trace);
+    auto progress = Progress{bmapFile.mappedBlocksCount, 0};
+    CopyStats stats;
+    using FlushMode = CopyOptions::FlushMode;
+    switch (options.flushMode) {
+    case FlushMode::Auto:
+        stats.flushMode = FlushMode::End;
+        break;
+    case FlushMode::Fua:
+        stats.flushMode = FlushMode::Range;
+        break;
+    default:
+        stats.flushMode = options.flushMode;
+    }
+    size_t unflushed = 0;
+    const auto flush = [&](size_t offset) {
+        detail::TraceSpan span(TraceRecorder::Event::Sync, offset, 0);
+        const auto start = std::chrono::steady_clock::now();
+        sink.sync();
+        stats.syncs++;
+        stats.syncSeconds += std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+        unflushed = 0;
+    };
+
+    const bool verify = options.verifyChecksums &&
+                        Checksum::supported(bmapFile.checksumType);
+    Checksum hash(verify ? bmapFile.checksumType : "sha256",
+                  detail::threadCount(0));
+
+    detail::ChunkPlanner planner(bmapFile);
+    for (detail::ChunkPlanner::Chunk chunk; planner.next(options.ioSize, chunk);) {
+        // the last block of the image may be partial
+        const auto bytes =
+            std::min(chunk.bytes, bmapFile.imageSize - chunk.offset);
+        const auto written = sink.fill(
+            chunk.offset, bytes, [&](uint8_t *dst, size_t done, size_t count) {
+                size_t len = 0;
+                {
+                    detail::TraceSpan span(TraceRecorder::Event::Read,
+                                           chunk.offset + done, count);
+                    len = source.read(chunk.offset + done, dst, count);
+                }
+                if (verify) {
+                    detail::TraceSpan span(TraceRecorder::Event::Hash,
+                                           chunk.offset + done, len);
+                    hash.update(dst, len);
+                }
+                return len;
+            });
+        if (written < bytes) {
+            throw std::runtime_error(std::format(
+                "Unexpected end of image at offset {}: read {} of {} bytes",
+                std::to_string(chunk.offset), std::to_string(written),
+                std::to_string(bytes)));
+        }
+        stats.bytesWritten += written;
+        stats.chunks++;
+        progress.blocksWritten += chunk.blocks;
+        unflushed += written;
+        if (callback)
+            callback(progress);
+
+        if ((stats.flushMode == FlushMode::Periodic &&
+             unflushed >= options.flushInterval) ||
+            (stats.flushMode == FlushMode::Range && chunk.last))
+            flush(chunk.offset);
+
+        if (!chunk.last)
+            continue;
+
+        const auto &range = bmapFile.blockMap[chunk.range];
+        if (verify && !range.checksum.empty()) {
+            const auto checksum = hash.hexdigest();
+            if (checksum != range.checksum) {
+                throw std::runtime_error(std::format(
+                    "Checksum mismatch for range {}-{}: expected {} got {}",
+                    std::to_string(range.offset),
+                    std::to_string(range.offset + range.blockCount - 1),
+                    range.checksum, checksum));
+            }
+        }
+        hash.reset();
+    }
+    if (unflushed > 0)
+        flush(bmapFile.imageSize);
+
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - startTime)
+                        .count();
+    stats.queueDepth = 1;
+    stats.ioSize = options.ioSize;
+    return stats;
+}
+
+} // namespace bmap
+
+#endif
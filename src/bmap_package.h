@@ -0,0 +1,295 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_PACKAGE_H
+#define BMAP_PACKAGE_H
+
+#include <zlib.h>
+
+#include "bmap_create.h"
+
+namespace bmap {
+
+struct PackageOptions {
+    CreateOptions create;
+    // zlib level, 0-9
+    int compressionLevel = Z_DEFAULT_COMPRESSION;
+    // uncompressed bytes per gzip member, members are compressed in parallel
+    size_t memberSize = 4 * 1024 * 1024;
+};
+
+struct PackageStats {
+    size_t bytesRead = 0;
+    size_t bytesCompressed = 0;
+    double seconds = 0;
+};
+
+namespace detail {
+namespace package {
+
+// one complete gzip member, concatenated members form a valid .gz file
+inline std::vector<uint8_t> gzipMember(const uint8_t *data, size_t len,
+                                       int level) {
+    z_stream zs{};
+    // 15 window bits + 16 for the gzip header and trailer
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        throw std::runtime_error("deflateInit failed");
+    }
+    std::vector<uint8_t> out(deflateBound(&zs, len));
+    zs.next_in = const_cast<uint8_t *>(data);
+    zs.avail_in = len;
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+    const auto ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        throw std::runtime_error("Compressing image failed");
+    }
+    return out;
+}
+
+struct Window {
+    size_t offset;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> compressed;
+    bool taken = false;
+    bool compressedDone = false;
+    bool hashed = false;
+    std::exception_ptr error;
+};
+
+} // namespace package
+} // namespace detail
+
+/**
+    Creates the bmap and a gzip compressed copy of the image in a single
+    pass. The image is mapped first (holes or filesystem bitmaps, no data is
+    read for that), then read front to back once: windows of `memberSize`
+    bytes are compressed into independent gzip members on worker threads
+    while a hashing thread calculates the range checksums in order.
+    The members are written in order to `compressedPath`, the result is a
+    regular multi-member .gz file that gunzip, pigz and bmaptools read.
+*/
+inline BmapFile package(const std::string &imagePath,
+                        const std::string &compressedPath,
+                        const PackageOptions &options = {},
+                        PackageStats *stats = nullptr) {
+    using detail::package::Window;
+
+    detail::validate(options.create);
+    const auto startTime = std::chrono::steady_clock::now();
+
+    detail::FileDescriptor file(::open(imagePath.c_str(), O_RDONLY));
+    if (file.get() < 0) {
+        throw std::runtime_error(std::format("Unable to open image {}: {}",
+                                             imagePath, strerror(errno)));
+    }
+    struct stat st;
+    if (::fstat(file.get(), &st) != 0) {
+        throw std::runtime_error(
+            std::format("Unable to stat image {}", imagePath));
+    }
+    const auto imageSize = size_t(st.st_size);
+    const auto blockSize = options.create.blockSize;
+    const auto threads = detail::threadCount(options.create.threads);
+    const auto memberSize = std::max<size_t>(blockSize, options.memberSize);
+
+    auto blockMap = detail::mapRanges(file.get(), imageSize, options.create);
+    size_t mappedBlocksCount = 0;
+    for (const auto &range : blockMap)
+        mappedBlocksCount += range.blockCount;
+
+    detail::FileDescriptor out(
+        ::open(compressedPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (out.get() < 0) {
+        throw std::runtime_error(
+            std::format("Unable to create {}: {}", compressedPath,
+                        std::string(strerror(errno))));
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // std::deque keeps references stable on push_back/pop_front
+    std::deque<Window> windows;
+    size_t popped = 0;
+    size_t hashedCount = 0;
+    bool done = false;
+    bool stopping = false;
+
+    const auto fail = [&](Window &window) {
+        std::lock_guard lock(mutex);
+        window.error = std::current_exception();
+        stopping = true;
+        cv.notify_all();
+    };
+
+    std::vector<std::thread> compressors;
+    for (unsigned t = 0; t < threads; t++) {
+        compressors.emplace_back([&]() {
+            for (;;) {
+                Window *window = nullptr;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&]() {
+                        if (stopping)
+                            return true;
+                        for (auto &pending : windows) {
+                            if (!pending.taken) {
+                                window = &pending;
+                                return true;
+                            }
+                        }
+                        return done;
+                    });
+                    if (stopping || window == nullptr)
+                        return;
+                    window->taken = true;
+                }
+                try {
+                    auto compressed = detail::package::gzipMember(
+                        window->data.data(), window->data.size(),
+                        options.compressionLevel);
+                    std::lock_guard lock(mutex);
+                    window->compressed = std::move(compressed);
+                    window->compressedDone = true;
+                } catch (...) {
+                    fail(*window);
+                    return;
+                }
+                cv.notify_all();
+            }
+        });
+    }
+
+    // checksums have to see the data in order, BLAKE3 still uses all cores
+    std::thread hasher([&]() {
+        Checksum checksum(options.create.checksumType, threads);
+        size_t rangeIdx = 0;
+        for (;;) {
+            Window *window = nullptr;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [&]() {
+                    return stopping || hashedCount - popped < windows.size() ||
+                           done;
+                });
+                if (stopping || hashedCount - popped == windows.size())
+                    return;
+                window = &windows[hashedCount - popped];
+            }
+            try {
+                const auto start = window->offset;
+                const auto end = start + window->data.size();
+                while (rangeIdx < blockMap.size()) {
+                    auto &range = blockMap[rangeIdx];
+                    const auto rangeStart = range.offset * blockSize;
+                    const auto rangeEnd = std::min(
+                        imageSize, (range.offset + range.blockCount) * blockSize);
+                    if (rangeStart >= end)
+                        break;
+                    const auto from = std::max(start, rangeStart);
+                    const auto to = std::min(end, rangeEnd);
+                    checksum.update(window->data.data() + (from - start),
+                                    to - from);
+                    if (rangeEnd > end)
+                        break;
+                    range.checksum = checksum.hexdigest();
+                    rangeIdx++;
+                }
+            } catch (...) {
+                fail(*window);
+                return;
+            }
+            {
+                std::lock_guard lock(mutex);
+                window->hashed = true;
+                hashedCount++;
+            }
+            cv.notify_all();
+        }
+    });
+
+    PackageStats result;
+    const auto maxWindows = size_t(threads) * 2 + 2;
+    std::exception_ptr error;
+    try {
+        for (size_t offset = 0; offset < imageSize || !windows.empty();) {
+            std::unique_lock lock(mutex);
+            if (offset < imageSize && windows.size() < maxWindows) {
+                lock.unlock();
+                Window window;
+                window.offset = offset;
+                window.data.resize(std::min(memberSize, imageSize - offset));
+                detail::readExact(file.get(), offset, window.data.data(),
+                                  window.data.size());
+                offset += window.data.size();
+                result.bytesRead += window.data.size();
+                lock.lock();
+                windows.push_back(std::move(window));
+                done = offset >= imageSize;
+                cv.notify_all();
+                continue;
+            }
+
+            cv.wait(lock, [&]() {
+                return stopping || (windows.front().compressedDone &&
+                                    windows.front().hashed);
+            });
+            for (const auto &window : windows) {
+                if (window.error)
+                    std::rethrow_exception(window.error);
+            }
+            auto window = std::move(windows.front());
+            windows.pop_front();
+            popped++;
+            lock.unlock();
+            cv.notify_all();
+
+            detail::writeAt(out.get(), result.bytesCompressed,
+                            window.compressed.data(), window.compressed.size());
+            result.bytesCompressed += window.compressed.size();
+        }
+        // an empty image is an empty gzip member
+        if (imageSize == 0) {
+            const auto member =
+                detail::package::gzipMember(nullptr, 0, options.compressionLevel);
+            detail::writeAt(out.get(), 0, member.data(), member.size());
+            result.bytesCompressed = member.size();
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        done = true;
+        stopping = stopping || error;
+    }
+    cv.notify_all();
+    for (auto &compressor : compressors)
+        compressor.join();
+    hasher.join();
+    if (error)
+        std::rethrow_exception(error);
+    if (::fsync(out.get()) != 0) {
+        throw std::runtime_error(
+            std::format("Unable to sync {}", compressedPath));
+    }
+
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - startTime)
+                         .count();
+    if (stats)
+        *stats = result;
+
+    const auto blocksCount = (imageSize + blockSize - 1) / blockSize;
+    return BmapFile{imageSize,         blockSize, blocksCount,
+                    mappedBlocksCount, options.create.checksumType, "",
+                    std::move(blockMap)};
+}
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,399 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_PROBE_H
+#define BMAP_PROBE_H
+
+#include <cstdlib>
+#include <memory>
+#include <random>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct ProbeOptions {
+    std::vector<size_t> ioSizes = {128 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    std::vector<size_t> queueDepths = {1, 4, 16};
+    // duration of a single run, including the final sync
+    double secondsPerRun = 0.15;
+    // also measure O_DIRECT writes
+    bool tryDirect = true;
+    // reuse results of an earlier probe of the same device for a bmap with
+    // the same block size and layout
+    bool useCache = true;
+    // empty: $XDG_CACHE_HOME/bmap-cpp/probe or ~/.cache/bmap-cpp/probe
+    std::string cachePath;
+};
+
+struct ProbeRun {
+    bool direct;
+    bool random;
+    size_t ioSize;
+    size_t queueDepth;
+    // bytes per second
+    double throughput;
+};
+
+struct ProbeResult {
+    // vendor, model and serial of the device (device number and size if it
+    // has no serial), the path for regular files
+    std::string deviceId;
+    bool cached = false;
+
+    // chosen settings
+    bool direct = false;
+    size_t ioSize = MAX_BUF_SIZE;
+    size_t queueDepth = 1;
+    double throughput = 0;
+
+    std::vector<ProbeRun> runs;
+
+    /**
+        Puts the chosen settings into `options`. A measured probe left
+        random data in the mapped ranges, so all-zero chunks can't be
+        skipped anymore; they are zeroed instead.
+    */
+    void apply(CopyOptions &options) const {
+        options.directIo = direct;
+        options.ioSize = ioSize;
+        options.queueDepth = queueDepth;
+        if (!cached && options.zeroChunks == CopyOptions::ZeroChunks::Skip)
+            options.zeroChunks = CopyOptions::ZeroChunks::ZeroOut;
+    }
+};
+
+namespace detail {
+
+inline std::string readSysfs(const std::filesystem::path &path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    const auto first = value.find_first_not_of(" \t");
+    const auto last = value.find_last_not_of(" \t");
+    return first == std::string::npos ? ""
+                                      : value.substr(first, last - first + 1);
+}
+
+/**
+    Identifies the device behind `targetDisk` by the vendor, model and serial
+    from sysfs. Devices without a serial or WWID (loop, some mmc and nvme
+    devices) are told apart by their device number and size instead.
+    Partitions resolve to their disk.
+*/
+inline std::string deviceId(const std::string &targetDisk) {
+    struct stat st;
+    if (::stat(targetDisk.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return std::format("file:{}",
+                           std::filesystem::weakly_canonical(targetDisk).string());
+    }
+
+    std::error_code ec;
+    auto sysDir = std::filesystem::canonical(
+        std::format("/sys/dev/block/{}:{}", std::to_string(major(st.st_rdev)),
+                    std::to_string(minor(st.st_rdev))),
+        ec);
+    if (ec)
+        return targetDisk;
+    if (std::filesystem::exists(sysDir / "partition"))
+        sysDir = sysDir.parent_path();
+
+    const auto device = sysDir / "device";
+    auto serial = readSysfs(device / "serial");
+    if (serial.empty())
+        serial = readSysfs(device / "wwid");
+    if (serial.empty())
+        serial = readSysfs(sysDir / "wwid");
+    if (serial.empty()) {
+        serial = std::format("dev {} size {}", readSysfs(sysDir / "dev"),
+                             readSysfs(sysDir / "size"));
+    }
+    return std::format("{} {} {}", readSysfs(device / "vendor"),
+                       readSysfs(device / "model"), serial);
+}
+
+inline std::filesystem::path probeCachePath(const ProbeOptions &options) {
+    if (!options.cachePath.empty())
+        return options.cachePath;
+    if (const auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return std::filesystem::path(xdg) / "bmap-cpp" / "probe";
+    if (const auto home = std::getenv("HOME"); home && *home)
+        return std::filesystem::path(home) / ".cache" / "bmap-cpp" / "probe";
+    return {};
+}
+
+/**
+    Cache lines are "key \t direct \t ioSize \t queueDepth \t throughput".
+    The key is the device id, the block size and whether the random or the
+    sequential runs were picked: the result depends on the bmap only through
+    those.
+*/
+inline std::string probeKey(const std::string &deviceId, size_t blockSize,
+                            bool fragmented) {
+    return std::format("{}\t{}\t{}", deviceId, std::to_string(blockSize),
+                       fragmented ? "random" : "sequential");
+}
+
+inline bool loadProbe(const std::filesystem::path &cachePath,
+                      const std::string &key, ProbeResult &result) {
+    std::ifstream cache(cachePath);
+    for (std::string line; std::getline(cache, line);) {
+        if (!line.starts_with(key + "\t"))
+            continue;
+        std::istringstream fields(line.substr(key.size() + 1));
+        if (fields >> result.direct >> result.ioSize >> result.queueDepth >>
+            result.throughput) {
+            result.cached = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void storeProbe(const std::filesystem::path &cachePath,
+                       const std::string &key, const ProbeResult &result) {
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(cachePath);
+        for (std::string line; std::getline(cache, line);) {
+            if (!line.starts_with(key + "\t"))
+                lines.push_back(line);
+        }
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(cachePath.parent_path(), ec);
+    std::ofstream cache(cachePath, std::ios::out | std::ios::trunc);
+    for (const auto &line : lines)
+        cache << line << "\n";
+    cache << key << "\t" << result.direct << "\t" << result.ioSize
+          << "\t" << result.queueDepth << "\t" << result.throughput << "\n";
+}
+
+/**
+    Byte regions the probe may write to: the mapped ranges, clipped to whole
+    I/O alignment units, since copy overwrites them afterwards anyway.
+*/
+class ProbeRegions {
+  public:
+    explicit ProbeRegions(const BmapFile &bmapFile) {
+        for (const auto &range : bmapFile.blockMap) {
+            const auto start =
+                (range.offset * bmapFile.blockSize + IO_ALIGNMENT - 1) /
+                IO_ALIGNMENT * IO_ALIGNMENT;
+            const auto end =
+                std::min((range.offset + range.blockCount) * bmapFile.blockSize,
+                         bmapFile.imageSize) /
+                IO_ALIGNMENT * IO_ALIGNMENT;
+            if (end > start)
+                regions.push_back({start, end - start});
+        }
+    }
+
+    // sequential offsets through all regions large enough for `ioSize`,
+    // wrapping around at the end. Returns false if there is no such region
+    bool nextSequential(size_t ioSize, size_t &offset) {
+        for (size_t tries = 0; tries <= regions.size(); tries++) {
+            if (seqRegion >= regions.size()) {
+                seqRegion = 0;
+                seqPos = 0;
+            }
+            const auto &region = regions[seqRegion];
+            if (seqPos + ioSize <= region.length) {
+                offset = region.offset + seqPos;
+                seqPos += ioSize;
+                return true;
+            }
+            seqRegion++;
+            seqPos = 0;
+        }
+        return false;
+    }
+
+    // aligned random offset, uniformly distributed over all possible
+    // positions in regions large enough for `ioSize`
+    bool nextRandom(size_t ioSize, std::mt19937_64 &rng, size_t &offset) {
+        if (randomIoSize != ioSize) {
+            randomIoSize = ioSize;
+            slots.clear();
+            size_t total = 0;
+            for (size_t idx = 0; idx < regions.size(); idx++) {
+                if (regions[idx].length >= ioSize) {
+                    total += (regions[idx].length - ioSize) / IO_ALIGNMENT + 1;
+                    slots.push_back({total, idx});
+                }
+            }
+        }
+        if (slots.empty())
+            return false;
+
+        auto slot = std::uniform_int_distribution<size_t>(
+            0, slots.back().first - 1)(rng);
+        const auto it = std::upper_bound(
+            slots.begin(), slots.end(), slot,
+            [](size_t val, const auto &entry) { return val < entry.first; });
+        if (it != slots.begin())
+            slot -= std::prev(it)->first;
+        offset = regions[it->second].offset + slot * IO_ALIGNMENT;
+        return true;
+    }
+
+    void rewind() {
+        seqRegion = 0;
+        seqPos = 0;
+    }
+
+  private:
+    struct Region {
+        size_t offset;
+        size_t length;
+    };
+    std::vector<Region> regions;
+    size_t seqRegion = 0;
+    size_t seqPos = 0;
+    size_t randomIoSize = 0;
+    // (cumulative slot count, region index)
+    std::vector<std::pair<size_t, size_t>> slots;
+};
+
+// bytes per second of one run, 0 if no region fits the I/O size
+inline double probeRun(Sink &sink, ProbeRegions &regions, bool random,
+                       size_t ioSize, size_t queueDepth, double seconds,
+                       std::mt19937_64 &rng) {
+    using Clock = std::chrono::steady_clock;
+
+    // incompressible data, so devices can't shortcut zeroes or patterns
+    std::vector<IoBuffer> freeBuffers(queueDepth, IoBuffer(ioSize));
+    for (auto &buffer : freeBuffers) {
+        for (auto &byte : buffer)
+            byte = uint8_t(rng());
+    }
+
+    regions.rewind();
+    WriteQueue queue(sink, queueDepth);
+    size_t bytes = 0;
+    const auto start = Clock::now();
+    const auto deadline =
+        start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(seconds));
+    const auto reap = [&]() {
+        for (auto &completion : queue.reap()) {
+            bytes += completion.bytes;
+            freeBuffers.push_back(std::move(completion.buffer));
+        }
+    };
+
+    while (Clock::now() < deadline) {
+        while (queue.pending() >= queueDepth)
+            reap();
+        size_t offset;
+        if (!(random ? regions.nextRandom(ioSize, rng, offset)
+                     : regions.nextSequential(ioSize, offset))) {
+            return 0;
+        }
+        auto buffer = std::move(freeBuffers.back());
+        freeBuffers.pop_back();
+        queue.submit(offset, std::move(buffer), ioSize, 0);
+    }
+    while (queue.pending() > 0)
+        reap();
+    sink.sync();
+
+    return bytes / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+} // namespace detail
+
+/**
+    Measures sequential and random write throughput of `targetDisk` for the
+    configured I/O sizes and queue depths, buffered and with O_DIRECT, and
+    picks the fastest settings for copying `bmapFile`. The probe only writes
+    to mapped ranges of `bmapFile`, which the following copy overwrites.
+    Results are cached per device, block size and layout, see probeKey.
+*/
+inline ProbeResult probe(const std::string &targetDisk,
+                         const BmapFile &bmapFile,
+                         const ProbeOptions &options = {}) {
+    ProbeResult result;
+    result.deviceId = detail::deviceId(targetDisk);
+
+    // prefer the random runs if the average range is smaller than the
+    // largest probed I/O
+    const auto avgRangeBytes =
+        bmapFile.blockMap.empty()
+            ? 0
+            : bmapFile.mappedBlocksCount * bmapFile.blockSize /
+                  bmapFile.blockMap.size();
+    const bool fragmented =
+        avgRangeBytes <
+        *std::max_element(options.ioSizes.begin(), options.ioSizes.end());
+
+    const auto cachePath = detail::probeCachePath(options);
+    const auto key =
+        detail::probeKey(result.deviceId, bmapFile.blockSize, fragmented);
+    if (options.useCache && !cachePath.empty() &&
+        detail::loadProbe(cachePath, key, result)) {
+        return result;
+    }
+
+    detail::ProbeRegions regions(bmapFile);
+    std::mt19937_64 rng(std::random_device{}());
+    const auto smallestIo =
+        *std::min_element(options.ioSizes.begin(), options.ioSizes.end());
+
+    std::vector<FileSink::Mode> modes = {FileSink::Mode::Buffered};
+    if (options.tryDirect)
+        modes.push_back(FileSink::Mode::Direct);
+
+    for (const auto mode : modes) {
+        std::unique_ptr<FileSink> sink;
+        try {
+            sink = std::make_unique<FileSink>(targetDisk, mode);
+        } catch (const std::runtime_error &) {
+            // e.g. O_DIRECT on tmpfs
+            continue;
+        }
+        const bool direct = mode == FileSink::Mode::Direct;
+
+        for (const auto depth : options.queueDepths) {
+            for (const auto ioSize : options.ioSizes) {
+                result.runs.push_back(ProbeRun{
+                    direct, false, ioSize, depth,
+                    detail::probeRun(*sink, regions, false, ioSize, depth,
+                                     options.secondsPerRun, rng)});
+            }
+            // fragmented bmaps mostly issue small writes all over the device
+            result.runs.push_back(ProbeRun{
+                direct, true, smallestIo, depth,
+                detail::probeRun(*sink, regions, true, smallestIo, depth,
+                                 options.secondsPerRun, rng)});
+        }
+    }
+
+    const ProbeRun *best = nullptr;
+    for (const auto &run : result.runs) {
+        if (run.random != fragmented || run.throughput <= 0)
+            continue;
+        if (!best || run.throughput > best->throughput)
+            best = &run;
+    }
+    if (!best) {
+        throw std::runtime_error(
+            "Probe failed, no mapped range is large enough to probe");
+    }
+
+    result.direct = best->direct;
+    result.ioSize = best->ioSize;
+    result.queueDepth = best->queueDepth;
+    result.throughput = best->throughput;
+
+    if (!cachePath.empty())
+        detail::storeProbe(cachePath, key, result);
+    return result;
+}
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,260 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_QCOW2_H
+#define BMAP_QCOW2_H
+
+#include <zlib.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+namespace detail {
+namespace qcow2 {
+
+constexpr uint8_t MAGIC[4] = {'Q', 'F', 'I', 0xfb};
+constexpr size_t HEADER_SIZE = 104;
+
+constexpr uint64_t L1_OFFSET_MASK = 0x00fffffffffffe00ULL;
+constexpr uint64_t L2_OFFSET_MASK = 0x00fffffffffffe00ULL;
+constexpr uint64_t L2_COMPRESSED = 1ULL << 62;
+constexpr uint64_t L2_ZERO = 1ULL;
+
+// incompatible feature bits
+constexpr uint64_t FEATURE_DIRTY = 1ULL << 0;
+constexpr uint64_t FEATURE_COMPRESSION_TYPE = 1ULL << 3;
+
+inline uint32_t get32(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+           uint32_t(p[3]);
+}
+
+inline uint64_t get64(const uint8_t *p) {
+    return uint64_t(get32(p)) << 32 | get32(p + 4);
+}
+
+} // namespace qcow2
+} // namespace detail
+
+/**
+    Reads the guest data of a qcow2 (version 2 or 3) virtual disk image, so
+    it can be flashed without converting it to raw first. The L1/L2 tables
+    are loaded once; bmap() derives the range plan from the allocated
+    clusters, no bmap file is needed.
+
+    Unallocated and zero clusters read as zeroes. zlib compressed clusters
+    are inflated on the reading thread, reads are thread safe so
+    `CopyOptions::readAhead` decompresses several chunks in parallel.
+    Backing files, encryption and zstd compression are not supported.
+*/
+class Qcow2Source : public Source {
+  public:
+    explicit Qcow2Source(const std::string &path)
+        : file(::open(path.c_str(), O_RDONLY)) {
+        using namespace detail::qcow2;
+
+        if (file.get() < 0) {
+            throw std::runtime_error(std::format(
+                "Unable to open image {}: {}", path, strerror(errno)));
+        }
+        std::array<uint8_t, HEADER_SIZE> header{};
+        // version 2 headers are only 72 bytes
+        const auto headerLen =
+            detail::readAt(file.get(), 0, header.data(), header.size());
+        if (headerLen < 72 || std::memcmp(header.data(), MAGIC, 4) != 0) {
+            throw std::runtime_error(
+                std::format("{} is not a qcow2 image", path));
+        }
+        const auto version = get32(&header[4]);
+        if (version != 2 && version != 3) {
+            throw std::runtime_error(std::format(
+                "Unsupported qcow2 version {}", std::to_string(version)));
+        }
+        if (get64(&header[8]) != 0) {
+            throw std::runtime_error(std::format(
+                "{} has a backing file, flatten it with qemu-img convert", path));
+        }
+        clusterBits = get32(&header[20]);
+        if (clusterBits < 9 || clusterBits > 21) {
+            throw std::runtime_error(std::format(
+                "Invalid qcow2 cluster size 2^{}", std::to_string(clusterBits)));
+        }
+        virtualSize = get64(&header[24]);
+        if (get32(&header[32]) != 0) {
+            throw std::runtime_error("Encrypted qcow2 images are not supported");
+        }
+        const auto l1Size = get32(&header[36]);
+        const auto l1Offset = get64(&header[40]);
+        if (version == 3 && headerLen >= HEADER_SIZE) {
+            const auto incompatible = get64(&header[72]);
+            if ((incompatible & ~FEATURE_DIRTY) != 0) {
+                throw std::runtime_error(std::format(
+                    "Unsupported qcow2 features{}",
+                    incompatible & FEATURE_COMPRESSION_TYPE
+                        ? std::string(" (zstd compression)")
+                        : std::string()));
+            }
+        }
+
+        const auto clusters =
+            (virtualSize + clusterSize() - 1) / clusterSize();
+        const auto entriesPerTable = clusterSize() / 8;
+        if (l1Size < (clusters + entriesPerTable - 1) / entriesPerTable) {
+            throw std::runtime_error("qcow2 L1 table too small for the image");
+        }
+
+        std::vector<uint8_t> l1(size_t(l1Size) * 8);
+        detail::readExact(file.get(), l1Offset, l1.data(), l1.size());
+        std::vector<uint8_t> table(clusterSize());
+        l2.assign(clusters, 0);
+        for (size_t idx = 0; idx * entriesPerTable < clusters; idx++) {
+            const auto tableOffset = get64(&l1[idx * 8]) & L1_OFFSET_MASK;
+            if (tableOffset == 0)
+                continue;
+            detail::readExact(file.get(), tableOffset, table.data(),
+                              table.size());
+            const auto first = idx * entriesPerTable;
+            const auto count = std::min(entriesPerTable, clusters - first);
+            for (size_t entry = 0; entry < count; entry++)
+                l2[first + entry] = get64(&table[entry * 8]);
+        }
+    }
+
+    size_t imageSize() const { return virtualSize; }
+    size_t clusterSize() const { return size_t(1) << clusterBits; }
+
+    /**
+        Range plan of the allocated clusters, in blocks of `blockSize` (at
+        most one cluster). The ranges have no checksums, the image has no
+        reference to verify against.
+    */
+    BmapFile bmap(size_t blockSize = 4096) const {
+        blockSize = std::min(blockSize, clusterSize());
+        const auto perCluster = clusterSize() / blockSize;
+        const auto blocksCount = (virtualSize + blockSize - 1) / blockSize;
+
+        std::vector<Range> blockMap;
+        size_t mappedBlocksCount = 0;
+        for (size_t cluster = 0; cluster < l2.size(); cluster++) {
+            if (!allocated(l2[cluster]))
+                continue;
+            const auto first = cluster * perCluster;
+            const auto count = std::min(perCluster, blocksCount - first);
+            if (!blockMap.empty() &&
+                blockMap.back().offset + blockMap.back().blockCount == first) {
+                blockMap.back().blockCount += count;
+            } else {
+                blockMap.push_back(Range{first, count, std::string()});
+            }
+            mappedBlocksCount += count;
+        }
+        return BmapFile{virtualSize, blockSize, blocksCount, mappedBlocksCount,
+                        "sha256",    "",        std::move(blockMap)};
+    }
+
+    size_t compressedClusters() const {
+        return std::ranges::count_if(l2, [](uint64_t entry) {
+            return (entry & detail::qcow2::L2_COMPRESSED) != 0;
+        });
+    }
+
+    size_t read(size_t offset, uint8_t *buf, size_t len) override {
+        if (offset >= virtualSize)
+            return 0;
+        len = std::min(len, virtualSize - offset);
+        std::vector<uint8_t> scratch;
+        for (size_t done = 0; done < len;) {
+            const auto pos = offset + done;
+            const auto cluster = pos >> clusterBits;
+            const auto inCluster = pos & (clusterSize() - 1);
+            const auto count = std::min(len - done, clusterSize() - inCluster);
+            const auto entry = l2[cluster];
+
+            if (!allocated(entry)) {
+                std::memset(buf + done, 0, count);
+            } else if (entry & detail::qcow2::L2_COMPRESSED) {
+                // whole clusters inflate straight into the caller's buffer
+                if (count == clusterSize()) {
+                    inflateCluster(entry, buf + done);
+                } else {
+                    scratch.resize(clusterSize());
+                    inflateCluster(entry, scratch.data());
+                    std::memcpy(buf + done, scratch.data() + inCluster, count);
+                }
+            } else {
+                detail::readExact(file.get(),
+                                  (entry & detail::qcow2::L2_OFFSET_MASK) +
+                                      inCluster,
+                                  buf + done, count);
+            }
+            done += count;
+        }
+        return len;
+    }
+
+    bool concurrentReads() const override { return true; }
+
+    // true if `path` starts with the qcow2 magic
+    static bool probe(const std::string &path) {
+        detail::FileDescriptor fd(::open(path.c_str(), O_RDONLY));
+        uint8_t magic[4] = {};
+        return fd.get() >= 0 &&
+               detail::readAt(fd.get(), 0, magic, sizeof(magic)) == 4 &&
+               std::memcmp(magic, detail::qcow2::MAGIC, 4) == 0;
+    }
+
+  private:
+    static bool allocated(uint64_t entry) {
+        using namespace detail::qcow2;
+        if (entry & L2_COMPRESSED)
+            return true;
+        // the zero flag wins over a preallocated host cluster
+        return (entry & L2_ZERO) == 0 && (entry & L2_OFFSET_MASK) != 0;
+    }
+
+    void inflateCluster(uint64_t entry, uint8_t *out) const {
+        // compressed descriptor: host offset in the low bits, then the
+        // number of additional 512 byte sectors
+        const auto offsetBits = 62 - (clusterBits - 8);
+        const auto hostOffset = entry & ((uint64_t(1) << offsetBits) - 1);
+        const auto sectors =
+            ((entry & ~detail::qcow2::L2_COMPRESSED) >> offsetBits) + 1;
+        const auto size = sectors * 512 - (hostOffset & 511);
+
+        detail::TraceSpan span(TraceRecorder::Event::Decompress, hostOffset,
+                               clusterSize());
+        std::vector<uint8_t> compressed(size);
+        // the last compressed cluster may end before the sector count says
+        compressed.resize(
+            detail::readAt(file.get(), hostOffset, compressed.data(), size));
+
+        z_stream zs{};
+        // raw deflate without a zlib header. qemu compresses with a 4 KiB
+        // window, the largest one inflates streams of other writers too
+        if (inflateInit2(&zs, -15) != Z_OK) {
+            throw std::runtime_error("inflateInit failed");
+        }
+        zs.next_in = compressed.data();
+        zs.avail_in = compressed.size();
+        zs.next_out = out;
+        zs.avail_out = clusterSize();
+        const auto ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || zs.avail_out != 0) {
+            throw std::runtime_error(std::format(
+                "Corrupt compressed qcow2 cluster at {}",
+                std::to_string(hostOffset)));
+        }
+    }
+
+    detail::FileDescriptor file;
+    unsigned clusterBits = 16;
+    size_t virtualSize = 0;
+    // L2 entry of every guest cluster
+    std::vector<uint64_t> l2;
+};
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,276 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_SIMULATE_H
+#define BMAP_SIMULATE_H
+
+#include <random>
+
+#include <sys/stat.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+/**
+    Timing model of a simulated block device. All times are wall clock, the
+    simulated sink really sleeps so benchmarks of the copy engine measure
+    what a real device of this kind would show.
+*/
+struct SimulatedDeviceProfile {
+    std::string name;
+    // sustained media write bandwidth in bytes/s
+    double bandwidth = 20e6;
+    // fixed cost per write, overlaps between parallel writes
+    std::chrono::microseconds latency{1000};
+    // writes the device works on at once, more in flight just queue up
+    size_t maxParallel = 1;
+    // volatile write cache, writes land in it at cacheBandwidth while there
+    // is room and drain to the media at `bandwidth` in the background
+    size_t writeCacheSize = 0;
+    double cacheBandwidth = 0;
+    // base cost of a cache flush (fsync), plus draining the dirty cache
+    std::chrono::microseconds flushLatency{0};
+    // writes that only partially cover an erase block cost a read and a
+    // rewrite of the whole erase block, unless they continue sequentially in
+    // one of the `openEraseBlocks` blocks the controller keeps open (like a
+    // flash translation layer does). 0 disables the penalty
+    size_t eraseBlockSize = 0;
+    size_t openEraseBlocks = 1;
+    // probability of a write failing with an I/O error
+    double failureRate = 0;
+
+    static SimulatedDeviceProfile from_name(const std::string &name) {
+        using us = std::chrono::microseconds;
+        constexpr const size_t MiB = 1024 * 1024;
+        if (name == "usb-stick")
+            return {name, 12e6, us(2000), 1, 0, 0, us(0), 4 * MiB, 1};
+        if (name == "sd-card")
+            return {name, 25e6, us(1000), 2, 0, 0, us(0), 4 * MiB, 2};
+        if (name == "emmc")
+            return {name, 90e6,       us(300),  4,          8 * MiB,
+                    200e6, us(5000), 512 * 1024, 4};
+        if (name == "sata-ssd")
+            return {name, 450e6, us(60), 32, 64 * MiB, 1.2e9, us(2000), 0, 0};
+        if (name == "nvme")
+            return {name, 2e9, us(20), 64, 256 * MiB, 3e9, us(1000), 0, 0};
+        throw std::runtime_error(std::format(
+            "Unknown device profile '{}', expected one of usb-stick, sd-card, "
+            "emmc, sata-ssd, nvme",
+            name));
+    }
+};
+
+/**
+    Sink simulating a slow or faulty device on top of a sparse backing file.
+    The data is written to the file unchanged, the profile only determines
+    how long each write and sync takes (or whether it fails).
+*/
+class SimulatedSink : public Sink {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        size_t writes = 0;
+        size_t bytes = 0;
+        size_t flushes = 0;
+        size_t readModifyWrites = 0;
+        size_t failures = 0;
+    };
+
+    // the backing file is created and extended to `size` bytes if needed
+    SimulatedSink(const std::string &backingPath, size_t size,
+                  SimulatedDeviceProfile profile)
+        : file(::open(backingPath.c_str(), O_WRONLY | O_CREAT, 0644)),
+          profile(std::move(profile)), lastDrain(Clock::now()),
+          mediaFree(lastDrain), rng(std::random_device{}()) {
+        if (file.get() < 0) {
+            throw std::runtime_error(
+                std::format("Unable to open backing file {}: {}", backingPath,
+                            strerror(errno)));
+        }
+        struct stat st;
+        if (::fstat(file.get(), &st) == 0 && size_t(st.st_size) < size &&
+            ::ftruncate(file.get(), size) != 0) {
+            throw std::runtime_error(std::format(
+                "Unable to resize backing file {}", backingPath));
+        }
+    }
+
+    void write(size_t offset, const uint8_t *buf, size_t len) override {
+        {
+            std::unique_lock lock(mutex);
+            slotCv.wait(lock, [this]() { return busy < profile.maxParallel; });
+            busy++;
+        }
+        // frees the slot however write() returns, e.g. when writeAt throws
+        struct Slot {
+            SimulatedSink &sink;
+            ~Slot() {
+                {
+                    std::lock_guard lock(sink.mutex);
+                    sink.busy--;
+                }
+                sink.slotCv.notify_one();
+            }
+        } slot{*this};
+
+        Clock::time_point done;
+        bool fail = false;
+        {
+            std::lock_guard lock(mutex);
+            const auto now = Clock::now();
+            drainCache(now);
+
+            stats.writes++;
+            fail = profile.failureRate > 0 &&
+                   std::uniform_real_distribution<double>(0, 1)(rng) <
+                       profile.failureRate;
+
+            // bytes the media has to program, erase blocks that have to be
+            // read and written back as a whole add to it
+            const auto rmw = readModifyWrites(offset, len);
+            stats.readModifyWrites += rmw;
+            const auto mediaBytes =
+                double(len) + 2.0 * rmw * profile.eraseBlockSize;
+
+            double transferSeconds;
+            if (profile.writeCacheSize > 0 &&
+                dirty + mediaBytes <= double(profile.writeCacheSize)) {
+                dirty += mediaBytes;
+                transferSeconds = len / profile.cacheBandwidth;
+            } else {
+                transferSeconds = mediaBytes / profile.bandwidth;
+            }
+
+            // the transfer serializes on the shared media/bus, the fixed
+            // latency overlaps between parallel writes
+            mediaFree = std::max(mediaFree, now) + toDuration(transferSeconds);
+            done = mediaFree + profile.latency;
+        }
+
+        std::this_thread::sleep_until(done);
+        if (!fail)
+            detail::writeAt(file.get(), offset, buf, len);
+
+        {
+            std::lock_guard lock(mutex);
+            if (fail) {
+                stats.failures++;
+            } else {
+                stats.bytes += len;
+            }
+        }
+
+        if (fail) {
+            throw std::runtime_error(std::format(
+                "Simulated I/O error writing at offset {}",
+                std::to_string(offset)));
+        }
+    }
+
+    void sync() override {
+        Clock::time_point done;
+        {
+            std::lock_guard lock(mutex);
+            const auto now = Clock::now();
+            drainCache(now);
+            stats.flushes++;
+            const auto flushSeconds = dirty / profile.bandwidth;
+            dirty = 0;
+            mediaFree = std::max(mediaFree, now) + toDuration(flushSeconds) +
+                        profile.flushLatency;
+            done = mediaFree;
+        }
+        std::this_thread::sleep_until(done);
+        if (::fsync(file.get()) != 0) {
+            throw std::runtime_error(
+                std::format("fsync failed: {}", std::string(strerror(errno))));
+        }
+    }
+
+    // profiles with a volatile cache report write back, like the device
+    WriteCache writeCache() const override {
+        return {profile.writeCacheSize > 0 ? WriteCache::Mode::WriteBack
+                                           : WriteCache::Mode::WriteThrough,
+                false};
+    }
+
+    Stats statistics() const {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+  private:
+    static Clock::duration toDuration(double seconds) {
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(seconds));
+    }
+
+    // Only the head and tail erase block of a write can be partially
+    // covered. A partial write is free if it starts a new erase block or
+    // continues at the write pointer of an open one.
+    size_t readModifyWrites(size_t offset, size_t len) {
+        const auto eb = profile.eraseBlockSize;
+        if (eb == 0 || len == 0)
+            return 0;
+
+        size_t penalties = 0;
+        const auto segment = [&](size_t block, size_t start, size_t end) {
+            auto it = std::find_if(openBlocks.begin(), openBlocks.end(),
+                                   [&](const auto &open) {
+                                       return open.first == block;
+                                   });
+            const bool sequential =
+                start == 0 || (it != openBlocks.end() && it->second == start);
+            if (!sequential)
+                penalties++;
+            if (it != openBlocks.end())
+                openBlocks.erase(it);
+            if (end < eb) {
+                // most recently used at the back
+                openBlocks.emplace_back(block, end);
+                if (openBlocks.size() > std::max<size_t>(1, profile.openEraseBlocks))
+                    openBlocks.erase(openBlocks.begin());
+            }
+        };
+
+        const auto firstBlock = offset / eb;
+        const auto lastBlock = (offset + len - 1) / eb;
+        if (firstBlock == lastBlock) {
+            segment(firstBlock, offset % eb, offset % eb + len);
+        } else {
+            segment(firstBlock, offset % eb, eb);
+            segment(lastBlock, 0, (offset + len - 1) % eb + 1);
+        }
+        return penalties;
+    }
+
+    // the cache drains to the media at full bandwidth while it is idle
+    void drainCache(Clock::time_point now) {
+        if (dirty > 0 && now > mediaFree) {
+            const auto idle = std::chrono::duration<double>(
+                now - std::max(lastDrain, mediaFree));
+            dirty = std::max(0.0, dirty - idle.count() * profile.bandwidth);
+        }
+        lastDrain = now;
+    }
+
+    detail::FileDescriptor file;
+    const SimulatedDeviceProfile profile;
+
+    mutable std::mutex mutex;
+    std::condition_variable slotCv;
+    size_t busy = 0;
+    double dirty = 0;
+    Clock::time_point lastDrain;
+    Clock::time_point mediaFree;
+    std::mt19937_64 rng;
+    // (erase block, write pointer) of partially written erase blocks
+    std::vector<std::pair<size_t, size_t>> openBlocks;
+    Stats stats;
+};
+
+} // namespace bmap
+
+#endif
@@ -0,0 +1,235 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_STATIC_H
+#define BMAP_STATIC_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+
+namespace bmap {
+
+/**
+    Range of a StaticBmapFile. The checksum points into the bmap text.
+*/
+struct StaticRange {
+    size_t offset = 0;
+    size_t blockCount = 0;
+    std::string_view checksum;
+};
+
+/**
+    Bmap parsed at compile time into a fixed-size range table. Needs neither
+    tinyxml2 nor the heap, the ranges are sorted and validated the same way
+    BmapFile::normalized() checks them.
+*/
+template <size_t N> struct StaticBmapFile {
+    size_t imageSize = 0;
+    size_t blockSize = 0;
+    size_t blocksCount = 0;
+    size_t mappedBlocksCount = 0;
+
+    std::string_view checksumType;
+    std::string_view checksum;
+
+    std::array<StaticRange, N> blockMap{};
+};
+
+namespace detail {
+namespace static_xml {
+
+// not constexpr on purpose: reaching it during constant evaluation turns
+// the message into a compile error, at runtime it throws like from_xml
+[[noreturn]] inline void fail(const char *what) {
+    throw std::runtime_error(what);
+}
+
+constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+constexpr std::string_view trim(std::string_view text) {
+    while (!text.empty() && isSpace(text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && isSpace(text.back()))
+        text.remove_suffix(1);
+    return text;
+}
+
+constexpr size_t toSize(std::string_view text) {
+    text = trim(text);
+    if (text.empty())
+        fail("bmap: number expected");
+    size_t value = 0;
+    for (const auto c : text) {
+        if (c < '0' || c > '9')
+            fail("bmap: invalid number");
+        value = value * 10 + size_t(c - '0');
+    }
+    return value;
+}
+
+/**
+    Position of the next `<name` start tag at or after `from`, skipping
+    comments. npos if there is none.
+*/
+constexpr size_t findTag(std::string_view xml, std::string_view name,
+                         size_t from = 0) {
+    for (auto pos = xml.find('<', from); pos != std::string_view::npos;
+         pos = xml.find('<', pos + 1)) {
+        if (xml.substr(pos, 4) == "<!--") {
+            pos = xml.find("-->", pos);
+            if (pos == std::string_view::npos)
+                fail("bmap: unterminated comment");
+            continue;
+        }
+        const auto after = pos + 1 + name.size();
+        if (xml.substr(pos + 1, name.size()) == name && after < xml.size() &&
+            (xml[after] == '>' || isSpace(xml[after])))
+            return pos;
+    }
+    return std::string_view::npos;
+}
+
+struct Element {
+    // text between the start tag and `</name>`
+    std::string_view attributes;
+    std::string_view text;
+    size_t end;
+};
+
+constexpr Element element(std::string_view xml, std::string_view name,
+                          size_t start) {
+    const auto open = xml.find('>', start);
+    const auto close = xml.find("</", open);
+    if (open == std::string_view::npos || close == std::string_view::npos ||
+        xml.substr(close + 2, name.size()) != name)
+        fail("bmap: malformed element");
+    return Element{xml.substr(start + 1 + name.size(), open - start - 1 - name.size()),
+                   xml.substr(open + 1, close - open - 1), close + 2 + name.size()};
+}
+
+constexpr std::string_view text(std::string_view xml, std::string_view name) {
+    const auto start = findTag(xml, name);
+    if (start == std::string_view::npos)
+        fail("bmap: missing element");
+    return trim(element(xml, name, start).text);
+}
+
+constexpr std::string_view attribute(std::string_view attributes,
+                                     std::string_view name) {
+    for (auto pos = attributes.find(name); pos != std::string_view::npos;
+         pos = attributes.find(name, pos + 1)) {
+        if (pos > 0 && !isSpace(attributes[pos - 1]))
+            continue;
+        auto rest = attributes.substr(pos + name.size());
+        while (!rest.empty() && isSpace(rest.front()))
+            rest.remove_prefix(1);
+        if (rest.empty() || rest.front() != '=')
+            continue;
+        rest = trim(rest.substr(1));
+        if (rest.empty() || (rest.front() != '"' && rest.front() != '\''))
+            fail("bmap: malformed attribute");
+        const auto end = rest.find(rest.front(), 1);
+        if (end == std::string_view::npos)
+            fail("bmap: malformed attribute");
+        return rest.substr(1, end - 1);
+    }
+    return {};
+}
+
+} // namespace static_xml
+} // namespace detail
+
+/**
+    Number of `<Range>` elements in `xml`, the table size for parse_static.
+*/
+constexpr size_t range_count(std::string_view xml) {
+    using namespace detail::static_xml;
+    size_t count = 0;
+    for (auto pos = findTag(xml, "Range"); pos != std::string_view::npos;
+         pos = findTag(xml, "Range", pos + 1))
+        count++;
+    return count;
+}
+
+// the length of an array is known without scanning for the terminator,
+// which would hit the constexpr loop limit for bmaps above 256 KiB
+template <size_t M> constexpr size_t range_count(const char (&xml)[M]) {
+    return range_count(std::string_view(xml, M - 1));
+}
+
+/**
+    Parses a bmap embedded as a string literal. Meant for constant
+    initialization, invalid bmaps then fail to compile:
+
+        constexpr char xml[] = R"(<?xml ... </bmap>)";
+        constexpr auto image = bmap::parse_static<bmap::range_count(xml)>(xml);
+
+    Checksums are views into `xml`, which therefore has to outlive the
+    result (string literals always do).
+*/
+template <size_t N>
+constexpr StaticBmapFile<N> parse_static(std::string_view xml) {
+    using namespace detail::static_xml;
+
+    StaticBmapFile<N> bmapFile;
+    bmapFile.imageSize = toSize(text(xml, "ImageSize"));
+    bmapFile.blockSize = toSize(text(xml, "BlockSize"));
+    bmapFile.blocksCount = toSize(text(xml, "BlocksCount"));
+    bmapFile.mappedBlocksCount = toSize(text(xml, "MappedBlocksCount"));
+    bmapFile.checksumType = text(xml, "ChecksumType");
+    bmapFile.checksum = text(xml, "BmapFileChecksum");
+    if (bmapFile.blockSize == 0)
+        fail("bmap: block size of 0");
+
+    size_t idx = 0;
+    for (auto pos = findTag(xml, "Range"); pos != std::string_view::npos;
+         pos = findTag(xml, "Range", pos + 1)) {
+        if (idx == N)
+            fail("bmap: more ranges than the table holds");
+        const auto range = element(xml, "Range", pos);
+        const auto value = trim(range.text);
+        const auto dash = value.find('-');
+        const auto first = toSize(value.substr(0, dash));
+        const auto last =
+            dash == std::string_view::npos ? first : toSize(value.substr(dash + 1));
+        if (last < first)
+            fail("bmap: range ends before it starts");
+        bmapFile.blockMap[idx++] = StaticRange{first, last - first + 1,
+                                               attribute(range.attributes, "chksum")};
+    }
+    if (idx != N)
+        fail("bmap: fewer ranges than the table holds");
+
+    std::sort(bmapFile.blockMap.begin(), bmapFile.blockMap.end(),
+              [](const StaticRange &a, const StaticRange &b) {
+                  return a.offset < b.offset;
+              });
+    size_t end = 0;
+    size_t mapped = 0;
+    for (const auto &range : bmapFile.blockMap) {
+        if (range.offset < end)
+            fail("bmap: overlapping ranges");
+        if (range.offset > bmapFile.blocksCount ||
+            range.blockCount > bmapFile.blocksCount - range.offset)
+            fail("bmap: range past the end of the image");
+        end = range.offset + range.blockCount;
+        mapped += range.blockCount;
+    }
+    if (mapped != bmapFile.mappedBlocksCount)
+        fail("bmap: MappedBlocksCount does not match the ranges");
+    return bmapFile;
+}
+
+template <size_t N, size_t M>
+constexpr StaticBmapFile<N> parse_static(const char (&xml)[M]) {
+    return parse_static<N>(std::string_view(xml, M - 1));
+}
+
+} // namespace bmap
+
+#endif
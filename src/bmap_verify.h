@@ -0,0 +1,264 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_VERIFY_H
+#define BMAP_VERIFY_H
+
+#include <optional>
+
+#include <sys/mman.h>
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct VerifyOptions {
+    // hashing threads. 0 = one per core
+    unsigned threads = 0;
+    // map regular files instead of reading them
+    bool mmap = true;
+};
+
+struct VerifyResult {
+    struct RangeResult {
+        size_t range;
+        // false for ranges without a checksum in the bmap: not verified,
+        // but not failed either
+        bool checked;
+        bool ok;
+        // the checksum calculated from the image, empty if not checked
+        std::string checksum;
+    };
+
+    // one entry per range of the bmap, in bmap order
+    std::vector<RangeResult> ranges;
+    // ranges without a checksum
+    size_t rangesUnchecked = 0;
+    size_t bytesVerified = 0;
+    double seconds = 0;
+    // byte offset of the first range that failed
+    std::optional<size_t> firstFailure;
+
+    bool ok() const { return !firstFailure; }
+    double throughput() const { return seconds > 0 ? bytesVerified / seconds : 0; }
+};
+
+namespace detail {
+
+/**
+    Runs fn(item) or fn(worker, item) (see invokeWorker) for all items on
+    `threads` workers. Each worker owns a
+    deque of items and takes from its front; a worker that runs out steals
+    from the back of the fullest deque. Items should come largest first, so
+    a few huge ranges start early and the small ones fill the gaps.
+    `idle`, if given, counts the workers that found nothing left to take.
+*/
+template <typename Fn>
+void workStealingFor(const std::vector<size_t> &items, unsigned threads,
+                     const Fn &fn, std::atomic<unsigned> *idle = nullptr) {
+    threads = unsigned(std::min<size_t>(threads, items.size()));
+    if (threads <= 1) {
+        for (const auto item : items)
+            invokeWorker(fn, 0, item);
+        return;
+    }
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> items;
+    };
+    std::vector<Queue> queues(threads);
+    // deal round robin so every worker starts with one of the largest
+    for (size_t idx = 0; idx < items.size(); idx++)
+        queues[idx % threads].items.push_back(items[idx]);
+
+    const auto take = [&](unsigned self) -> std::optional<size_t> {
+        {
+            auto &own = queues[self];
+            std::lock_guard lock(own.mutex);
+            if (!own.items.empty()) {
+                const auto item = own.items.front();
+                own.items.pop_front();
+                return item;
+            }
+        }
+        for (;;) {
+            Queue *victim = nullptr;
+            size_t most = 0;
+            for (auto &queue : queues) {
+                std::lock_guard lock(queue.mutex);
+                if (queue.items.size() > most) {
+                    most = queue.items.size();
+                    victim = &queue;
+                }
+            }
+            if (!victim)
+                return std::nullopt;
+            std::lock_guard lock(victim->mutex);
+            // emptied since it was picked, look again
+            if (victim->items.empty())
+                continue;
+            const auto item = victim->items.back();
+            victim->items.pop_back();
+            return item;
+        }
+    };
+
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            try {
+                while (!failed) {
+                    const auto item = take(t);
+                    if (!item)
+                        break;
+                    invokeWorker(fn, t, *item);
+                }
+                if (idle)
+                    (*idle)++;
+            } catch (...) {
+                std::lock_guard lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+} // namespace detail
+
+/**
+    Checks the image or device at `path` against the range checksums of
+    `bmapFile` without writing anything. Ranges are hashed in parallel,
+    regular files straight from a read-only mapping, devices with pread.
+    Once no ranges are left to take, BLAKE3 ranges still being hashed share
+    the cores of the workers that ran out.
+*/
+inline VerifyResult verify(const std::string &path, const BmapFile &bmapFile,
+                           const VerifyOptions &options = {}) {
+    if (!Checksum::supported(bmapFile.checksumType)) {
+        throw std::runtime_error(std::format("Unsupported checksum type {}",
+                                             bmapFile.checksumType));
+    }
+    const auto startTime = std::chrono::steady_clock::now();
+
+    detail::FileDescriptor file(::open(path.c_str(), O_RDONLY));
+    if (file.get() < 0) {
+        throw std::runtime_error(
+            std::format("Unable to open {}: {}", path, strerror(errno)));
+    }
+    struct stat st;
+    if (::fstat(file.get(), &st) != 0) {
+        throw std::runtime_error(std::format("Unable to stat {}", path));
+    }
+    size_t size = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t bytes = 0;
+        if (::ioctl(file.get(), BLKGETSIZE64, &bytes) == 0)
+            size = bytes;
+    }
+
+    const uint8_t *mapped = nullptr;
+    if (options.mmap && S_ISREG(st.st_mode) && size > 0) {
+        const auto data =
+            ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.get(), 0);
+        if (data != MAP_FAILED) {
+            ::madvise(data, size, MADV_SEQUENTIAL);
+            mapped = static_cast<const uint8_t *>(data);
+        }
+    }
+    const std::unique_ptr<const uint8_t, std::function<void(const uint8_t *)>>
+        unmap(mapped, [size](const uint8_t *data) {
+            ::munmap(const_cast<uint8_t *>(data), size);
+        });
+
+    const auto &ranges = bmapFile.blockMap;
+    const auto rangeBytes = [&](const Range &range) {
+        const auto start = std::min(bmapFile.imageSize,
+                                    range.offset * bmapFile.blockSize);
+        const auto end =
+            std::min(bmapFile.imageSize,
+                     (range.offset + range.blockCount) * bmapFile.blockSize);
+        return std::pair{start, end};
+    };
+
+    VerifyResult result;
+    result.ranges.resize(ranges.size());
+    std::vector<size_t> order;
+    for (size_t idx = 0; idx < ranges.size(); idx++) {
+        const bool checked = !ranges[idx].checksum.empty();
+        result.ranges[idx] = {idx, checked, true, {}};
+        if (checked) {
+            order.push_back(idx);
+        } else {
+            result.rangesUnchecked++;
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return ranges[a].blockCount > ranges[b].blockCount;
+    });
+
+    const auto threads = detail::threadCount(options.threads);
+    std::atomic<size_t> bytesVerified{0};
+    std::atomic<unsigned> idle{0};
+    // the idle workers' share for each range still being hashed
+    const auto hashThreads = [&]() {
+        const auto free = std::min(idle.load(), threads - 1);
+        return 1 + free / (threads - free);
+    };
+    // read buffers of the pread path, one per worker
+    std::vector<IoBuffer> buffers(threads);
+    detail::workStealingFor(order, threads, [&](unsigned worker, size_t idx) {
+        const auto &range = ranges[idx];
+        const auto [start, end] = rangeBytes(range);
+        Checksum checksum(bmapFile.checksumType);
+        // the image may be shorter than the bmap says, the hash then fails
+        const auto available = std::min(end, std::max(start, size));
+        if (mapped) {
+            // in slices, so a range picks up workers that ran out meanwhile
+            constexpr size_t SLICE = 64 * 1024 * 1024;
+            for (auto pos = start; pos < available; pos += SLICE) {
+                checksum.setThreads(hashThreads());
+                checksum.update(mapped + pos, std::min(SLICE, available - pos));
+            }
+        } else {
+            auto &buff = buffers[worker];
+            buff.resize(std::min(available - start, MAX_BUF_SIZE));
+            for (auto pos = start; pos < available;) {
+                const auto len = std::min(buff.size(), available - pos);
+                detail::readExact(file.get(), pos, buff.data(), len);
+                checksum.setThreads(hashThreads());
+                checksum.update(buff.data(), len);
+                pos += len;
+            }
+        }
+        bytesVerified += available - start;
+        auto &rangeResult = result.ranges[idx];
+        rangeResult.checksum = checksum.hexdigest();
+        rangeResult.ok = rangeResult.checksum == range.checksum;
+    }, &idle);
+
+    for (const auto &rangeResult : result.ranges) {
+        if (rangeResult.ok)
+            continue;
+        const auto start = rangeBytes(ranges[rangeResult.range]).first;
+        result.firstFailure = std::min(result.firstFailure.value_or(start), start);
+    }
+    result.bytesVerified = bytesVerified;
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - startTime)
+                         .count();
+    return result;
+}
+
+} // namespace bmap
+
+#endif
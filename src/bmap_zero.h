@@ -0,0 +1,151 @@
+// SPDX-FileCopyrightText: 2023 Elena Gantner <https://github.com/theswiftfox>
+// SPDX-License-Identifier: MIT
+
+#ifndef BMAP_ZERO_H
+#define BMAP_ZERO_H
+
+#include "bmap.h"
+
+namespace bmap {
+
+struct ZeroVerifyOptions {
+    // bytes per read
+    size_t chunkSize = 4 * 1024 * 1024;
+    // reads in flight: reader threads, each with one blocking pread of
+    // `chunkSize` at a time
+    unsigned queueDepth = 16;
+    // read with O_DIRECT where possible, so the device and not the page
+    // cache is checked
+    bool direct = true;
+};
+
+struct ZeroVerifyResult {
+    size_t bytesChecked = 0;
+    double seconds = 0;
+    // byte offset and length of unmapped areas that are not zero, with
+    // bmap block granularity
+    std::vector<std::pair<size_t, size_t>> nonZeroExtents;
+
+    bool ok() const { return nonZeroExtents.empty(); }
+};
+
+namespace detail {
+
+// byte extents of the image that no range of `bmapFile` covers
+inline std::vector<std::pair<size_t, size_t>> unmappedExtents(const BmapFile &bmapFile) {
+    auto ranges = bmapFile.blockMap;
+    std::sort(ranges.begin(), ranges.end(),
+              [](const auto &a, const auto &b) { return a.offset < b.offset; });
+
+    std::vector<std::pair<size_t, size_t>> gaps;
+    size_t pos = 0;
+    for (const auto &range : ranges) {
+        const auto start = std::min(range.offset * bmapFile.blockSize, bmapFile.imageSize);
+        if (start > pos)
+            gaps.emplace_back(pos, start - pos);
+        pos = std::max(pos, std::min((range.offset + range.blockCount) *
+                                         bmapFile.blockSize,
+                                     bmapFile.imageSize));
+    }
+    if (pos < bmapFile.imageSize)
+        gaps.emplace_back(pos, bmapFile.imageSize - pos);
+    return gaps;
+}
+
+} // namespace detail
+
+/**
+    Checks that everything `bmapFile` does not map reads back as zeroes on
+    `targetDisk`, e.g. after the unmapped areas were discarded or zeroed for
+    a secure wipe. The gaps are read in chunks by `queueDepth` reader
+    threads issuing blocking preads, which keeps that many reads queued on
+    the device without an async I/O interface, and checked with the SIMD
+    zero kernel.
+*/
+inline ZeroVerifyResult verify_unmapped_zero(const std::string &targetDisk,
+                                             const BmapFile &bmapFile,
+                                             const ZeroVerifyOptions &options = {}) {
+    const auto startTime = std::chrono::steady_clock::now();
+    const auto blockSize = bmapFile.blockSize;
+    const auto chunkSize =
+        std::max(blockSize, options.chunkSize / blockSize * blockSize);
+
+    detail::FileDescriptor file(::open(targetDisk.c_str(), O_RDONLY));
+    if (file.get() < 0) {
+        throw std::runtime_error(std::format("Unable to open {}: {}",
+                                             targetDisk, strerror(errno)));
+    }
+    detail::FileDescriptor direct(
+        options.direct ? ::open(targetDisk.c_str(), O_RDONLY | O_DIRECT) : -1);
+
+    struct Chunk {
+        size_t offset;
+        size_t length;
+    };
+    std::vector<Chunk> chunks;
+    for (const auto &[offset, length] : detail::unmappedExtents(bmapFile)) {
+        for (size_t done = 0; done < length; done += chunkSize)
+            chunks.push_back({offset + done, std::min(chunkSize, length - done)});
+    }
+
+    std::vector<std::vector<std::pair<size_t, size_t>>> found(chunks.size());
+    std::atomic<size_t> bytesChecked{0};
+    const auto readers = std::max(1u, options.queueDepth);
+    // one per reader, freed when the check returns
+    std::vector<IoBuffer> buffers(readers);
+    detail::parallelFor(chunks.size(), readers,
+                        [&](unsigned worker, size_t idx) {
+        const auto &chunk = chunks[idx];
+        auto &buff = buffers[worker];
+        buff.resize(chunk.length);
+
+        const bool aligned = chunk.offset % IO_ALIGNMENT == 0 &&
+                             chunk.length % IO_ALIGNMENT == 0;
+        const auto fd = direct.get() >= 0 && aligned ? direct.get() : file.get();
+        const auto len = detail::readAt(fd, chunk.offset, buff.data(), chunk.length);
+        bytesChecked += len;
+        if (len < chunk.length) {
+            // device smaller than the image, the rest can't be zero
+            found[idx].emplace_back(chunk.offset + len, chunk.length - len);
+        }
+        if (detail::isZero(buff.data(), len))
+            return;
+
+        // narrow down to blocks
+        for (size_t pos = 0; pos < len; pos += blockSize) {
+            const auto count = std::min(blockSize, len - pos);
+            if (detail::isZero(buff.data() + pos, count))
+                continue;
+            auto &extents = found[idx];
+            if (!extents.empty() &&
+                extents.back().first + extents.back().second == chunk.offset + pos) {
+                extents.back().second += count;
+            } else {
+                extents.emplace_back(chunk.offset + pos, count);
+            }
+        }
+        std::sort(found[idx].begin(), found[idx].end());
+    });
+
+    ZeroVerifyResult result;
+    result.bytesChecked = bytesChecked;
+    for (const auto &extents : found) {
+        for (const auto &extent : extents) {
+            auto &merged = result.nonZeroExtents;
+            if (!merged.empty() &&
+                merged.back().first + merged.back().second == extent.first) {
+                merged.back().second += extent.second;
+            } else {
+                merged.push_back(extent);
+            }
+        }
+    }
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - startTime)
+                         .count();
+    return result;
+}
+
+} // namespace bmap
+
+#endif
@@ -43,6 +43,7 @@ std::string format(const std::string &fmt, std::string arg, Args... args) {
         result.append(toAppend[idx]);
 
         lastFmt = bracket + 2;
+        idx++;
     }
 
     if (lastFmt != fmt.end()) {
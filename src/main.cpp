@@ -1,24 +1,686 @@
+#include <charconv>
 #include <iostream>
 
 #define BMAP_COPY_DEBUG_PRINT
+#define BMAP_WITH_ZLIB
 #include "bmap.h"
+#include "bmap_cache.h"
+#include "bmap_create.h"
+#include "bmap_delta.h"
+#include "bmap_delta_image.h"
+#include "bmap_edit.h"
+#include "bmap_hotplug.h"
+#include "bmap_http.h"
+#include "bmap_manifest.h"
+#include "bmap_mmap.h"
+#include "bmap_package.h"
+#include "bmap_probe.h"
+#include "bmap_qcow2.h"
+#include "bmap_simulate.h"
+#include "bmap_verify.h"
+#include "bmap_zero.h"
+
+static void usage(const char *prog) {
+    std::cout << "Usage: " << prog
+              << " [--bmap /tmp/input.wic.bmap] /tmp/input.wic /dev/sdX\n"
+              << "       " << prog
+              << " [--bmap input.wic.bmap] http://server/input.wic /dev/sdX\n"
+              << "       " << prog << " [copy options] input.qcow2 /dev/sdX\n"
+              << "       " << prog
+              << " --bmap delta.bmap --delta-image delta.img /dev/sdX\n"
+              << "       " << prog
+              << " create [--fs] [--checksum sha256|blake3] [--gzip input.wic.gz] "
+                 "/tmp/input.wic [/tmp/input.wic.bmap]\n"
+              << "       " << prog
+              << " delta [--old-image old.wic --new-image new.wic]"
+                 " [--image-out delta.img] old.bmap new.bmap delta.bmap\n"
+              << "       " << prog << " verify-zero input.wic.bmap /dev/sdX\n"
+              << "       " << prog
+              << " verify [--threads N] input.wic|/dev/sdX [input.wic.bmap]\n"
+              << "       " << prog
+              << " normalize [--image input.wic] in.bmap out.bmap\n"
+              << "       " << prog
+              << " merge [--image input.wic] out.bmap in.bmap...\n"
+              << "       " << prog
+              << " subset [--image input.wic] in.bmap first-last out.bmap\n"
+              << "       " << prog
+              << " reblock [--image input.wic] in.bmap block-size out.bmap\n"
+              << "       " << prog
+              << " manifest [copy options] images.manifest /dev/sdX\n"
+              << "       " << prog
+              << " watch [copy options] [--vendor V] [--model M] [--min-size B]"
+                 " [--max-size B]\n"
+              << "             [--count N] input.wic\n"
+              << "       " << prog
+              << " cache-import cache-dir input.wic [input.wic.bmap]\n"
+              << "\n"
+              << "  --bmap       bmap to use instead of <input>.bmap, e.g. a "
+                 "delta bmap\n"
+              << "  --fs         only map blocks used by ext4/FAT filesystems\n"
+              << "  --old-image  compare changed ranges chunk by chunk\n"
+              << "  --new-image  (both images required)\n"
+              << "  --image-out  also write a delta image with the changed "
+                 "blocks of the new image\n"
+              << "  --delta-image  read the image data from a delta image "
+                 "(\"-\" for stdin)\n"
+              << "  --queue-depth  writes in flight (default 1)\n"
+              << "  --io-size      bytes per write (default 8 MiB)\n"
+              << "  --http-connections N  parallel connections for http:// "
+                 "images (default 4)\n"
+              << "  --adaptive     tune queue depth and I/O size while "
+                 "copying\n"
+              << "  --direct       write with O_DIRECT\n"
+              << "  --hybrid       O_DIRECT for writes of 512 KiB and more, "
+                 "small ones buffered\n"
+              << "  --read-ahead N   read N chunks ahead of the writer "
+                 "(default 0)\n"
+              << "  --read-threads N reader threads for --read-ahead "
+                 "(default 4)\n"
+              << "  --zero-chunks M  all-zero chunks: write (default), "
+                 "zeroout (BLKZEROOUT),\n"
+              << "                 skip (target is known to be zeroed)\n"
+              << "  --no-verify    don't verify the range checksums\n"
+              << "  --flush M      when to make the data durable: auto "
+                 "(default, by the\n"
+              << "                 device's write cache), range, periodic, "
+                 "end, fua\n"
+              << "  --trace FILE   record the copy as Chrome trace JSON (also "
+                 "on failure)\n"
+              << "  --mmap         write through shared mappings of the target "
+                 "(experimental)\n"
+              << "  --probe        measure the target first and pick I/O "
+                 "mode, size and depth\n"
+              << "  --cache DIR    take ranges found in the range cache DIR from "
+                 "there, add the others\n"
+              << "  --simulate P   write to a simulated device backed by the "
+                 "target file,\n"
+              << "                 P: usb-stick, sd-card, emmc, sata-ssd, nvme"
+              << std::endl;
+    std::exit(1);
+}
+
+// a number or usage(); std::stoul throws on letters and ignores trailing junk
+static size_t parseNumber(const char *prog, const std::string &text) {
+    size_t value = 0;
+    const auto end = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (text.empty() || ec != std::errc() || ptr != end)
+        usage(prog);
+    return value;
+}
+
+static void writeBmap(const bmap::BmapFile &bmapFile,
+                      const std::string &bmapPath) {
+    bmapFile.save(bmapPath);
+}
+
+static int create(int argc, char **argv) {
+    bmap::PackageOptions packageOptions;
+    auto &options = packageOptions.create;
+    std::string gzipPath;
+    std::vector<std::string> positional;
+    for (int i = 2; i < argc; i++) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--fs") {
+            options.mode = bmap::MappingMode::Filesystem;
+        } else if (arg == "--checksum" && i + 1 < argc) {
+            options.checksumType = argv[++i];
+        } else if (arg == "--gzip" && i + 1 < argc) {
+            gzipPath = argv[++i];
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.empty() || positional.size() > 2)
+        usage(argv[0]);
+
+    const auto imagePath = positional[0];
+    const auto bmapPath =
+        positional.size() > 1 ? positional[1] : imagePath + ".bmap";
+
+    bmap::PackageStats stats;
+    const auto bmapFile =
+        gzipPath.empty()
+            ? bmap::create(imagePath, options)
+            : bmap::package(imagePath, gzipPath, packageOptions, &stats);
+    writeBmap(bmapFile, bmapPath);
+    if (!gzipPath.empty()) {
+        std::cout << "Compressed " << stats.bytesRead << " to "
+                  << stats.bytesCompressed << " bytes in " << stats.seconds
+                  << " s" << std::endl;
+    }
+
+    std::cout << "Mapped " << bmapFile.mappedBlocksCount << " of "
+              << bmapFile.blocksCount << " blocks" << std::endl;
+    return 0;
+}
+
+static int delta(int argc, char **argv) {
+    bmap::DeltaOptions options;
+    std::string deltaImagePath;
+    std::vector<std::string> positional;
+    for (int i = 2; i < argc; i++) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--old-image" && i + 1 < argc) {
+            options.oldImagePath = argv[++i];
+        } else if (arg == "--new-image" && i + 1 < argc) {
+            options.newImagePath = argv[++i];
+        } else if (arg == "--image-out" && i + 1 < argc) {
+            deltaImagePath = argv[++i];
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 3 ||
+        (!deltaImagePath.empty() && options.newImagePath.empty()))
+        usage(argv[0]);
+
+    const auto oldBmap = bmap::BmapFile::from_xml(positional[0]);
+    const auto newBmap = bmap::BmapFile::from_xml(positional[1]);
+    const auto deltaBmap = bmap::delta(oldBmap, newBmap, options);
+    writeBmap(deltaBmap, positional[2]);
+    if (!deltaImagePath.empty()) {
+        bmap::write_delta_image(deltaBmap, options.newImagePath,
+                                deltaImagePath);
+    }
+
+    std::cout << "Delta maps " << deltaBmap.mappedBlocksCount << " of "
+              << newBmap.mappedBlocksCount << " blocks" << std::endl;
+    return 0;
+}
+
+static int verifyZero(int argc, char **argv) {
+    if (argc != 4)
+        usage(argv[0]);
+
+    const auto bmapFile = bmap::BmapFile::from_xml(argv[2]);
+    const auto result = bmap::verify_unmapped_zero(argv[3], bmapFile);
+    std::cout << "Checked " << result.bytesChecked << " unmapped bytes in "
+              << result.seconds << " s ("
+              << result.bytesChecked / result.seconds / (1024 * 1024)
+              << " MiB/s)" << std::endl;
+    for (const auto &[offset, length] : result.nonZeroExtents) {
+        std::cout << "Not zero: offset " << offset << " length " << length
+                  << std::endl;
+    }
+    return result.ok() ? 0 : 3;
+}
+
+static int verify(int argc, char **argv) {
+    bmap::VerifyOptions options;
+    std::vector<std::string> positional;
+    for (int i = 2; i < argc; i++) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--threads" && i + 1 < argc) {
+            options.threads = parseNumber(argv[0], argv[++i]);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.empty() || positional.size() > 2)
+        usage(argv[0]);
+
+    const auto bmapFile = bmap::BmapFile::from_xml(
+        positional.size() > 1 ? positional[1] : bmap::find_bmap(positional[0]));
+    const auto result = bmap::verify(positional[0], bmapFile, options);
+    size_t failed = 0;
+    for (const auto &range : result.ranges) {
+        if (range.ok)
+            continue;
+        const auto &bmapRange = bmapFile.blockMap[range.range];
+        std::cout << "FAIL range " << bmapRange.offset << "-"
+                  << bmapRange.offset + bmapRange.blockCount - 1 << ": expected "
+                  << bmapRange.checksum << " got " << range.checksum
+                  << std::endl;
+        failed++;
+    }
+    const auto checked = result.ranges.size() - result.rangesUnchecked;
+    std::cout << "Verified " << checked - failed << " of "
+              << result.ranges.size() << " ranges, "
+              << result.rangesUnchecked << " without checksum, "
+              << result.bytesVerified
+              << " bytes in " << result.seconds << " s ("
+              << result.throughput() / (1024 * 1024) << " MiB/s)" << std::endl;
+    if (result.firstFailure) {
+        std::cout << "First failing offset: " << *result.firstFailure
+                  << std::endl;
+    }
+    return result.ok() ? 0 : 3;
+}
+
+static int edit(int argc, char **argv) {
+    const auto command = std::string(argv[1]);
+    bmap::EditOptions options;
+    std::vector<std::string> positional;
+    for (int i = 2; i < argc; i++) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--image" && i + 1 < argc) {
+            options.imagePath = argv[++i];
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    bmap::BmapFile result;
+    std::string outPath;
+    if (command == "merge" && positional.size() >= 2) {
+        std::vector<bmap::BmapFile> inputs;
+        for (const auto &path : positional | std::views::drop(1))
+            inputs.push_back(bmap::BmapFile::from_xml(path));
+        result = bmap::merge(inputs, options);
+        outPath = positional[0];
+    } else if (command == "normalize" && positional.size() == 2) {
+        result = bmap::normalize(bmap::BmapFile::from_xml(positional[0]),
+                                 options);
+        outPath = positional[1];
+    } else if (command == "subset" && positional.size() == 3 &&
+               positional[1].find('-') != std::string::npos) {
+        const auto dash = positional[1].find('-');
+        const auto first = parseNumber(argv[0], positional[1].substr(0, dash));
+        const auto last = parseNumber(argv[0], positional[1].substr(dash + 1));
+        result = bmap::subset(bmap::BmapFile::from_xml(positional[0]), first,
+                              last, options);
+        outPath = positional[2];
+    } else if (command == "reblock" && positional.size() == 3) {
+        result = bmap::reblock(bmap::BmapFile::from_xml(positional[0]),
+                               parseNumber(argv[0], positional[1]), options);
+        outPath = positional[2];
+    } else {
+        usage(argv[0]);
+    }
+    writeBmap(result, outPath);
+
+    std::cout << "Wrote " << result.blockMap.size() << " ranges, "
+              << result.mappedBlocksCount << " of " << result.blocksCount
+              << " blocks mapped" << std::endl;
+    return 0;
+}
+
+static int cacheImport(int argc, char **argv) {
+    if (argc != 4 && argc != 5)
+        usage(argv[0]);
+
+    const auto imagePath = std::string(argv[3]);
+    const auto bmapFile = bmap::BmapFile::from_xml(
+        argc == 5 ? std::string(argv[4]) : bmap::find_bmap(imagePath));
+    bmap::RangeStore store(argv[2]);
+    const auto added = store.import(imagePath, bmapFile);
+    std::cout << "Added " << added << " of " << bmapFile.blockMap.size()
+              << " ranges to " << argv[2] << std::endl;
+    return 0;
+}
+
+static void printStats(const bmap::CopyStats &stats) {
+    std::cout << "Wrote " << stats.bytesWritten << " bytes in "
+              << stats.seconds << " s ("
+              << stats.throughput() / (1024 * 1024) << " MiB/s), queue depth "
+              << stats.queueDepth << ", I/O size " << stats.ioSize
+              << ", avg. write latency " << stats.avgLatencyMs << " ms"
+              << std::endl;
+    if (stats.bytesZeroed || stats.bytesSkipped) {
+        std::cout << "All-zero chunks: " << stats.bytesZeroed
+                  << " bytes zeroed, " << stats.bytesSkipped
+                  << " bytes skipped" << std::endl;
+    }
+    static constexpr const char *flushModes[] = {"auto", "range", "periodic",
+                                                 "end", "fua"};
+    std::cout << "Flush mode " << flushModes[size_t(stats.flushMode)] << ": "
+              << stats.syncs << " syncs (" << stats.syncSeconds << " s)";
+    if (stats.durableWrites)
+        std::cout << ", " << stats.durableWrites << " durable writes";
+    std::cout << std::endl;
+    if (stats.readStalls) {
+        std::cout << "Writer waited for data on " << stats.readStalls << " of "
+                  << stats.chunks << " chunks (" << stats.readStallSeconds
+                  << " s)" << std::endl;
+    }
+}
+
+static int copy(int argc, char **argv) {
+    std::string bmapPath;
+    std::string deltaImagePath;
+    bmap::CopyOptions options;
+    bmap::HttpOptions httpOptions;
+    std::string cacheDir;
+    std::string tracePath;
+    bool mmapTarget = false;
+    bool probe = false;
+    std::string simulateProfile;
+    bmap::HotplugOptions hotplugOptions;
+    bmap::HotplugRule hotplugRule;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        const auto arg = std::string(argv[i]);
+        if (arg == "--bmap" && i + 1 < argc) {
+            bmapPath = argv[++i];
+        } else if (arg == "--delta-image" && i + 1 < argc) {
+            deltaImagePath = argv[++i];
+        } else if (arg == "--queue-depth" && i + 1 < argc) {
+            options.queueDepth = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--io-size" && i + 1 < argc) {
+            options.ioSize = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--read-ahead" && i + 1 < argc) {
+            options.readAhead = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--read-threads" && i + 1 < argc) {
+            options.readThreads = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--http-connections" && i + 1 < argc) {
+            httpOptions.connections = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--direct") {
+            options.directIo = true;
+        } else if (arg == "--hybrid") {
+            options.directIo = true;
+            options.directMinSize = 512 * 1024;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--mmap") {
+            mmapTarget = true;
+        } else if (arg == "--probe") {
+            probe = true;
+        } else if (arg == "--zero-chunks" && i + 1 < argc) {
+            const auto mode = std::string(argv[++i]);
+            if (mode == "write") {
+                options.zeroChunks = bmap::CopyOptions::ZeroChunks::Write;
+            } else if (mode == "zeroout") {
+                options.zeroChunks = bmap::CopyOptions::ZeroChunks::ZeroOut;
+            } else if (mode == "skip") {
+                options.zeroChunks = bmap::CopyOptions::ZeroChunks::Skip;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (arg == "--no-verify") {
+            options.verifyChecksums = false;
+        } else if (arg == "--flush" && i + 1 < argc) {
+            using FlushMode = bmap::CopyOptions::FlushMode;
+            const auto mode = std::string(argv[++i]);
+            if (mode == "auto") {
+                options.flushMode = FlushMode::Auto;
+            } else if (mode == "range") {
+                options.flushMode = FlushMode::Range;
+            } else if (mode == "periodic") {
+                options.flushMode = FlushMode::Periodic;
+            } else if (mode == "end") {
+                options.flushMode = FlushMode::End;
+            } else if (mode == "fua") {
+                options.flushMode = FlushMode::Fua;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (arg == "--simulate" && i + 1 < argc) {
+            simulateProfile = argv[++i];
+        } else if (arg == "--vendor" && i + 1 < argc) {
+            hotplugRule.vendor = argv[++i];
+        } else if (arg == "--model" && i + 1 < argc) {
+            hotplugRule.model = argv[++i];
+        } else if (arg == "--min-size" && i + 1 < argc) {
+            hotplugRule.minSize = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--max-size" && i + 1 < argc) {
+            hotplugRule.maxSize = parseNumber(argv[0], argv[++i]);
+        } else if (arg == "--count" && i + 1 < argc) {
+            hotplugOptions.maxDevices = parseNumber(argv[0], argv[++i]);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    // the probe writes random data to the ranges skipped chunks rely on
+    if (probe && options.zeroChunks == bmap::CopyOptions::ZeroChunks::Skip) {
+        std::cerr << "--probe can't be combined with --zero-chunks skip, use "
+                     "zeroout"
+                  << std::endl;
+        return 1;
+    }
+    // the probe picks a queue depth and I/O mode the mapped copy doesn't use
+    if (probe && mmapTarget) {
+        std::cerr << "--probe can't be combined with --mmap" << std::endl;
+        return 1;
+    }
+
+    // saved when copy returns or throws, a trace of a failed copy is the
+    // interesting one
+    struct TraceFile {
+        std::string path;
+        std::optional<bmap::TraceRecorder> recorder;
+        ~TraceFile() {
+            if (!recorder)
+                return;
+            try {
+                recorder->save(path);
+                std::cout << "Trace: " << recorder->recorded()
+                          << " events written to " << path << std::endl;
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    } trace{tracePath, std::nullopt};
+    if (!tracePath.empty())
+        options.trace = &trace.recorder.emplace();
+
+    const auto runProbe = [&](const std::string &target,
+                              const bmap::BmapFile &bmapFile) {
+        if (!probe)
+            return;
+        const auto result = bmap::probe(target, bmapFile);
+        result.apply(options);
+        std::cout << "Probe" << (result.cached ? " (cached)" : "") << " of '"
+                  << result.deviceId << "': "
+                  << (result.direct ? "direct" : "buffered") << " I/O, "
+                  << result.ioSize << " bytes, queue depth "
+                  << result.queueDepth << ", "
+                  << result.throughput / (1024 * 1024) << " MiB/s"
+                  << std::endl;
+    };
+
+    std::optional<bmap::RangeStore> store;
+    if (!cacheDir.empty())
+        store.emplace(cacheDir);
+    const auto openTarget =
+        [&](const std::string &path,
+            const bmap::BmapFile &bmapFile) -> std::unique_ptr<bmap::Sink> {
+        if (mmapTarget)
+            return std::make_unique<bmap::MmapSink>(path, bmapFile.imageSize);
+        return std::make_unique<bmap::FileSink>(path, options);
+    };
+    const auto run = [&](bmap::Source &source, const bmap::BmapFile &bmapFile,
+                         bmap::Sink &sink) {
+        if (const auto mapped = dynamic_cast<bmap::MmapSink *>(&sink))
+            return bmap::copy_mapped(source, bmapFile, *mapped, nullptr, options);
+        return bmap::copy(source, bmapFile, sink, nullptr, options);
+    };
+    // copies from `source`, through the range cache if one is given
+    const auto copyFrom = [&](bmap::Source &source,
+                              const bmap::BmapFile &bmapFile, bmap::Sink &sink) {
+        if (!store) {
+            printStats(run(source, bmapFile, sink));
+            return;
+        }
+        bmap::CachedSource cached(source, bmapFile, *store);
+        printStats(run(cached, bmapFile, sink));
+        const auto cache = cached.statistics();
+        std::cout << "Cache: " << cache.cachedRanges << " ranges ("
+                  << cache.cachedBytes << " bytes) from the cache, "
+                  << cache.upstreamBytes << " bytes from the image, "
+                  << cache.addedRanges << " ranges added" << std::endl;
+    };
+
+    if (!deltaImagePath.empty()) {
+        if (bmapPath.empty() || positional.size() != 1)
+            usage(argv[0]);
+        const auto bmapFile = bmap::BmapFile::from_xml(bmapPath);
+        runProbe(positional[0], bmapFile);
+        bmap::DeltaImageSource source(deltaImagePath, bmapFile);
+        const auto sink = openTarget(positional[0], bmapFile);
+        copyFrom(source, bmapFile, *sink);
+        return 0;
+    }
+
+    // manifests and hotplug flashes always use the plain file sink
+    const char *sinkFlag = mmapTarget                  ? "--mmap"
+                           : probe                     ? "--probe"
+                           : !cacheDir.empty()         ? "--cache"
+                           : !simulateProfile.empty()  ? "--simulate"
+                                                       : nullptr;
+    if (!positional.empty() &&
+        (positional[0] == "manifest" || positional[0] == "watch") &&
+        sinkFlag) {
+        std::cerr << sinkFlag << " can't be combined with " << positional[0]
+                  << std::endl;
+        return 1;
+    }
+
+    if (positional.size() == 3 && positional[0] == "manifest") {
+        printStats(bmap::copy(bmap::Manifest::from_file(positional[1]),
+                              positional[2], nullptr, options));
+        return 0;
+    }
+
+    if (positional.size() == 2 && positional[0] == "watch") {
+        const auto bmapFile = bmap::BmapFile::from_xml(
+            bmapPath.empty() ? bmap::find_bmap(positional[1]) : bmapPath);
+        // a rule without any condition would flash every disk plugged in
+        if (hotplugRule.vendor.empty() && hotplugRule.model.empty() &&
+            hotplugRule.minSize == 0 && hotplugRule.maxSize == 0)
+            usage(argv[0]);
+        hotplugOptions.rules.push_back(hotplugRule);
+        bmap::FileSource source(positional[1]);
+        std::mutex outputMutex;
+        std::cout << "Waiting for devices..." << std::endl;
+        bmap::flash_on_hotplug(
+            source, bmapFile, hotplugOptions, options,
+            [&](const bmap::HotplugResult &result) {
+                std::lock_guard lock(outputMutex);
+                if (result.error) {
+                    try {
+                        std::rethrow_exception(result.error);
+                    } catch (const std::exception &e) {
+                        std::cerr << result.device << ": " << e.what()
+                                  << std::endl;
+                    }
+                    return;
+                }
+                std::cout << result.device << ": first write "
+                          << result.firstWriteMs << " ms after the event"
+                          << std::endl;
+                printStats(result.stats);
+            });
+        return 0;
+    }
+
+    if (positional.size() != 2)
+        usage(argv[0]);
+
+    if (positional[0].starts_with("http://")) {
+        const auto bmapFile =
+            bmapPath.empty()
+                ? bmap::BmapFile::from_xml_data(bmap::HttpSource::fetch(
+                      positional[0] + ".bmap", httpOptions))
+                : bmap::BmapFile::from_xml(bmapPath);
+        runProbe(positional[1], bmapFile);
+        // keep every connection busy with pipelined requests; the mapped
+        // copy reads in order
+        if (options.readAhead == 0 && !mmapTarget) {
+            options.readAhead =
+                httpOptions.connections * httpOptions.pipelineDepth;
+        }
+        options.readThreads = httpOptions.connections;
+        bmap::HttpSource source(positional[0], httpOptions);
+        const auto sink = openTarget(positional[1], bmapFile);
+        copyFrom(source, bmapFile, *sink);
+        const auto http = source.statistics();
+        std::cout << "HTTP: " << http.requests << " range requests, "
+                  << http.bytes << " bytes over " << http.connections
+                  << " connections" << std::endl;
+        return 0;
+    }
+
+    if (bmapPath.empty() && bmap::Qcow2Source::probe(positional[0])) {
+        // the range plan comes from the qcow2 cluster tables
+        bmap::Qcow2Source source(positional[0]);
+        const auto bmapFile = source.bmap();
+        runProbe(positional[1], bmapFile);
+        if (options.readAhead == 0 && !mmapTarget &&
+            source.compressedClusters() > 0) {
+            // inflate chunks on all cores, the mapped copy reads in order
+            options.readThreads = bmap::detail::threadCount(0);
+            options.readAhead = options.readThreads * 2;
+        }
+        const auto sink = openTarget(positional[1], bmapFile);
+        copyFrom(source, bmapFile, *sink);
+        return 0;
+    }
+
+    if (!simulateProfile.empty()) {
+        // the target is the sparse backing file of the simulated device
+        const auto bmapFile = bmap::BmapFile::from_xml(
+            bmapPath.empty() ? bmap::find_bmap(positional[0]) : bmapPath);
+        bmap::FileSource source(positional[0]);
+        bmap::SimulatedSink sink(
+            positional[1], bmapFile.imageSize,
+            bmap::SimulatedDeviceProfile::from_name(simulateProfile));
+        copyFrom(source, bmapFile, sink);
+        const auto sim = sink.statistics();
+        std::cout << "Simulated " << simulateProfile << ": " << sim.writes
+                  << " writes, " << sim.flushes << " flushes, "
+                  << sim.readModifyWrites << " erase block read-modify-writes"
+                  << std::endl;
+    } else if (probe || store || mmapTarget) {
+        const auto bmapFile = bmap::BmapFile::from_xml(
+            bmapPath.empty() ? bmap::find_bmap(positional[0]) : bmapPath);
+        runProbe(positional[1], bmapFile);
+        bmap::FileSource source(positional[0]);
+        const auto sink = openTarget(positional[1], bmapFile);
+        copyFrom(source, bmapFile, *sink);
+    } else if (bmapPath.empty()) {
+        printStats(bmap::copy(positional[0], positional[1], nullptr, options));
+    } else {
+        printStats(bmap::copy(positional[0], bmapPath, positional[1], nullptr,
+                              options));
+    }
+    return 0;
+}
 
 int main(int argc, char **argv) {
     if (argc < 3) {
-        std::cout << "Usage: " << std::string(argv[0])
-                  << " /tmp/input.wic /dev/sdX" << std::endl;
-        std::exit(1);
+        usage(argv[0]);
     }
 
-    const auto wicFilePath = std::string(argv[1]);
-    const auto targetDevice = std::string(argv[2]);
-
+    const auto command = std::string(argv[1]);
     try {
-        bmap::copy(wicFilePath, targetDevice);
+        if (command == "create") {
+            return create(argc, argv);
+        }
+        if (command == "delta") {
+            return delta(argc, argv);
+        }
+        if (command == "verify-zero") {
+            return verifyZero(argc, argv);
+        }
+        if (command == "cache-import") {
+            return cacheImport(argc, argv);
+        }
+        if (command == "verify") {
+            return verify(argc, argv);
+        }
+        if (command == "normalize" || command == "merge" ||
+            command == "subset" || command == "reblock") {
+            return edit(argc, argv);
+        }
+        return copy(argc, argv);
     } catch (const std::runtime_error &err) {
-        std::cerr << "Error during bmap copy: " << err.what() << std::endl;
+        const bool isCommand = command == "create" || command == "delta" ||
+                               command == "verify-zero" ||
+                               command == "manifest" || command == "watch" ||
+                               command == "cache-import" ||
+                               command == "verify" ||
+                               command == "normalize" || command == "merge" ||
+                               command == "subset" || command == "reblock";
+        std::cerr << "Error during bmap " << (isCommand ? command : "copy")
+                  << ": " << err.what() << std::endl;
         std::exit(2);
     }
 
     return 0;
-}
\ No newline at end of file
+}